@@ -12,4 +12,5 @@
 #SBATCH -t 00:05:00
 #SBATCH -o myoutput
 #SBATCH -e myerr
-srun --mpi=pmix_v3 ./mat_mult
+#(NRA, NCA_RB, NCB, [mode: p2p | collective | summa | pipeline | dynamic])
+srun --mpi=pmix_v3 ./mat_mult 60 12 10
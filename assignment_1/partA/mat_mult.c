@@ -1,214 +1,999 @@
-/*mat_mult.c */
-
-#include "mpi.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-#include <math.h>
-
-/*   ttype: type to use for representing time */
-typedef double ttype;
-ttype tdiff(const struct timespec start, const struct timespec stop)
-/* Find the time difference between start and stop. */
-{
-    ttype dt = (( stop.tv_sec - start.tv_sec ) + ( stop.tv_nsec - start.tv_nsec ) / 1E9);
-    return dt;
-}
-
-struct timespec now()
-/* Return the current time. */
-{
-    struct timespec t;
-    clock_gettime(CLOCK_REALTIME, &t);
-    return t;
-}
-
-
-
-#define NRA 60                 /* number of rows in matrix A */
-#define NCA 12                 /* number of columns in matrix A */
-#define NRB 12                 /* number of rows in matrix B, should equal to NCA */
-#define NCB 10                  /* number of columns in matrix B */
-#define MASTER 0               /* taskid of first task */
-#define FROM_MASTER 1          /* setting a message type */
-#define FROM_WORKER 2          /* setting a message type */
-
-void print_stats(const int num_stats, const double* const stats, const double master_elapsed) {
-    float max = 0, total = 0;
-
-    for(int i = 0; i < num_stats; i++) {
-        printf("Elapsed time of worker %d: %fs\n", i, stats[i]);
-
-        total += stats[i];
-
-        if (stats[i] > max) {
-            max = stats[i];
-        }
-    } // end of for
-
-    printf("Max time: %fs\n", max);
-    printf("Total time: %fs\n", total);
-
-    printf("Master elapased time: %fs\n", master_elapsed);
-}
-
-int main (int argc, char *argv[])
-{
-    int	numtasks,            /* number of tasks in partition */
-    taskid,                /* a task identifier */
-    numworkers,            /* number of worker tasks */
-    source,                /* task id of message source */
-    dest,                  /* task id of message destination */
-    mtype,                 /* message type */
-    rows,                  /* rows of matrix A sent to each worker */
-    averow, extra, offset, /* used to determine rows sent to each worker */
-    i, j, k, rc;           /* misc */
-    int	A[NRA][NCA],         /* matrix A to be multiplied */
-    B[NRB][NCB],           /* matrix B to be multiplied */
-    C[NRA][NCB];           /* result matrix C */
-    MPI_Status status;
-
-    //clock_t begin, end;
-    struct timespec begin, end;
-    double time_spent;
-
-    MPI_Init(&argc,&argv);
-    MPI_Comm_rank(MPI_COMM_WORLD,&taskid);
-    MPI_Comm_size(MPI_COMM_WORLD,&numtasks);
-    if (numtasks < 2 ) {
-        printf("Need at least two MPI tasks. Quitting...\n");
-        MPI_Abort(MPI_COMM_WORLD, rc);
-        exit(1);
-    }
-    numworkers = numtasks-1;
-
-    double* worker_elapsed_times = malloc(numworkers * sizeof(double));
-
-    /**************************** master task ************************************/
-    if (taskid == MASTER)
-    {
-
-        // Do some basic error checking
-        if (NRB != NCA) {
-            printf ("Matrix a column size must equal matrix b row size.\n");
-            return 1;
-        } 
-
-        printf("mpi_mm has started with %d tasks.\n",numtasks);
-        printf("Matrix A: #rows %d; #cols %d\n", NRA, NCA);
-        printf("Matrix B: #rows %d; #cols %d\n", NRB, NCB);
-        printf ("\n");
-
-        printf("Initializing arrays...\n");
-        for (i=0; i<NRA; i++)
-            for (j=0; j<NCA; j++)
-                A[i][j]= i+j;  
-
-        printf (" Contents of matrix A\n");
-        for (i=0; i<NRA; i++) {  
-            for (j=0; j<NCA; j++)
-                printf("%d\t", A[i][j]);
-            printf("\n");
-        }     
-
-        for (i=0; i<NRB; i++)   
-            for (j=0; j<NCB; j++)
-                B[i][j]= i-j;
-
-        printf (" Contents of matrix B\n");
-        for (i=0; i<NRB; i++) {  
-            for (j=0; j<NCB; j++)
-                printf("%d\t", B[i][j]);
-            printf("\n");
-            printf("\n");        
-        }     
-
-
-        /* Send matrix data to the worker tasks */
-        averow = NRA/numworkers;
-        extra = NRA%numworkers;
-        offset = 0;
-        mtype = FROM_MASTER;
-
-        //begin = clock();
-        begin = now();
-
-        for (dest=1; dest<=numworkers; dest++)
-            {
-                rows = (dest <= extra) ? averow+1 : averow;   	
-                printf("Sending %d rows to task %d offset=%d\n",rows,dest,offset);
-                MPI_Send(&offset, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
-                MPI_Send(&rows, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
-                MPI_Send(&A[offset][0], rows*NCA, MPI_INT, dest, mtype,
-                         MPI_COMM_WORLD);
-                MPI_Send(&B, NRB*NCB, MPI_INT, dest, mtype, MPI_COMM_WORLD);         
-                offset = offset + rows;
-            }
-
-        /* Receive results from worker tasks */
-        mtype = FROM_WORKER;
-        for (i=1; i<=numworkers; i++)
-            {
-                source = i;
-                MPI_Recv(&offset, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
-                MPI_Recv(&rows, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
-                MPI_Recv(&C[offset][0], rows*NCB, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
-                // Receive the elapsed time from the workers.
-                MPI_Recv(&worker_elapsed_times[source], 1, MPI_DOUBLE, source, mtype, MPI_COMM_WORLD, &status);
-                printf("Received results from task %d\n",source);
-            }
-
-
-        end = now();
-        time_spent = tdiff(begin, end);
-
-        /* Print results */
-        printf ("\n");
-        printf("******************************************************\n");
-        printf("Result Matrix:\n");
-        for (i=0; i<NRA; i++)
-            {
-                printf("\n"); 
-                for (j=0; j<NCB; j++) 
-                    printf("%d\t", C[i][j]);
-            }
-        printf("\n******************************************************\n");
-
-        print_stats(numworkers, worker_elapsed_times, time_spent);
-    }
-
-
-    /**************************** worker task ************************************/
-    if (taskid > MASTER)
-    {
-        struct timespec start, end;
-        mtype = FROM_MASTER;
-        MPI_Recv(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-        MPI_Recv(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-        MPI_Recv(&A, rows*NCA, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-        MPI_Recv(&B, NRB*NCB, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-
-        start = now();
-        // ------------------------------ 
-        for (i=0; i<rows; i++)
-            for (j=0; j<NCB; j++)
-                {
-                    C[i][j] = 0;
-                    for (k=0; k<NCA; k++)            
-                        C[i][j] = C[i][j] + A[i][k] * B[k][j];
-                }
-        // ------------------------------ 
-        end = now();
-
-        ttype elapsed = tdiff(start, end);
- 
-        mtype = FROM_WORKER;
-        MPI_Send(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
-        MPI_Send(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
-        MPI_Send(&C, rows*NCB, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
-        MPI_Send(&elapsed, 1, MPI_DOUBLE, MASTER, mtype, MPI_COMM_WORLD);
-    }
-    MPI_Finalize();
-
-    free(worker_elapsed_times);
-}
+/*mat_mult.c */
+
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "gemm.h"
+
+/*   ttype: type to use for representing time */
+typedef double ttype;
+ttype tdiff(const struct timespec start, const struct timespec stop)
+/* Find the time difference between start and stop. */
+{
+    ttype dt = (( stop.tv_sec - start.tv_sec ) + ( stop.tv_nsec - start.tv_nsec ) / 1E9);
+    return dt;
+}
+
+struct timespec now()
+/* Return the current time. */
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t;
+}
+
+
+
+#define MASTER 0               /* taskid of first task */
+#define FROM_MASTER 1          /* setting a message type */
+#define FROM_WORKER 2          /* setting a message type */
+#define MATRIX_ALIGN 64        /* byte alignment of matrix buffers (one cache line) */
+#define PRINT_MAX 200          /* only print matrices with at most this many rows and cols */
+#ifndef SUMMA_PANEL
+#define SUMMA_PANEL GEMM_KC    /* max width of the k panels broadcast each SUMMA step */
+#endif
+#ifndef PIPELINE_CHUNK
+#define PIPELINE_CHUNK 64      /* rows per chunk in pipeline mode */
+#endif
+#ifndef DYNAMIC_CHUNK
+#define DYNAMIC_CHUNK 16       /* smallest chunk (rows) handed out in dynamic mode */
+#endif
+
+/* C's checksum, summed in the widest type of C's kind. */
+#if GEMM_IS_FLOAT
+typedef double checksum;
+#define MPI_CHECKSUM MPI_DOUBLE
+#define CHECKSUM_FORMAT "%.10g"
+#else
+typedef long long checksum;
+#define MPI_CHECKSUM MPI_LONG_LONG
+#define CHECKSUM_FORMAT "%lld"
+#endif
+
+/* How the rows of A and C are handed out to the tasks. */
+enum mode {
+    MODE_P2P,                  /* master sends/receives each worker's slab with MPI_Send/MPI_Recv */
+    MODE_COLLECTIVE,           /* Bcast B, Scatterv/Gatherv the slabs; the master computes too */
+    MODE_SUMMA,                /* 2D process grid, SUMMA row/column panel broadcasts */
+    MODE_PIPELINE,             /* master/worker with nonblocking, double-buffered row chunks */
+    MODE_DYNAMIC,              /* workers ask the master for chunks sized by their measured speed */
+    NUM_MODES
+};
+
+const char* const mode_names[NUM_MODES] = {
+    [MODE_P2P] = "p2p",
+    [MODE_COLLECTIVE] = "collective",
+    [MODE_SUMMA] = "summa",
+    [MODE_PIPELINE] = "pipeline",
+    [MODE_DYNAMIC] = "dynamic",
+};
+
+/**
+ * Allocate a contiguous, cache-line aligned rows x cols matrix of
+ * `size`-byte elements.
+ * Index the result through a `gemm_elem (*)[cols]` (or gemm_acc) pointer.
+ */
+void* alloc_matrix(const int rows, const int cols, const size_t size, const char* const name) {
+    size_t bytes = (size_t)rows * cols * size;
+    // aligned_alloc wants a multiple of the alignment.
+    bytes = (bytes + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+
+    void* const matrix = aligned_alloc(MATRIX_ALIGN, bytes ? bytes : MATRIX_ALIGN);
+    if (matrix == NULL) {
+        printf("ERROR: Couldn't allocate %s (%d x %d).\n", name, rows, cols);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return matrix;
+}
+
+void print_stats(const int num_stats, const double* const stats, const double master_elapsed) {
+    float max = 0, total = 0;
+
+    for(int i = 0; i < num_stats; i++) {
+        printf("Elapsed time of worker %d: %fs\n", i, stats[i]);
+
+        total += stats[i];
+
+        if (stats[i] > max) {
+            max = stats[i];
+        }
+    } // end of for
+
+    printf("Max time: %fs\n", max);
+    printf("Total time: %fs\n", total);
+
+    printf("Master elapased time: %fs\n", master_elapsed);
+}
+
+/**
+ * Fill in A and B on the master and print them if they're small enough.
+ */
+void init_matrices(const int NRA, const int NCA, const int NCB, gemm_elem (* const A)[NCA], gemm_elem (* const B)[NCB]) {
+    const int NRB = NCA;
+    int i, j;
+
+    printf("Initializing arrays...\n");
+    for (i=0; i<NRA; i++)
+        for (j=0; j<NCA; j++)
+            A[i][j]= i+j;  
+
+    if (NRA <= PRINT_MAX && NCA <= PRINT_MAX) {
+        printf (" Contents of matrix A\n");
+        for (i=0; i<NRA; i++) {  
+            for (j=0; j<NCA; j++)
+                printf("%" GEMM_ELEM_FMT "\t", A[i][j]);
+            printf("\n");
+        }     
+    }
+
+    for (i=0; i<NRB; i++)   
+        for (j=0; j<NCB; j++)
+            B[i][j]= i-j;
+
+    if (NRB <= PRINT_MAX && NCB <= PRINT_MAX) {
+        printf (" Contents of matrix B\n");
+        for (i=0; i<NRB; i++) {  
+            for (j=0; j<NCB; j++)
+                printf("%" GEMM_ELEM_FMT "\t", B[i][j]);
+            printf("\n");
+            printf("\n");        
+        }     
+    }
+}
+
+/**
+ * Sum of every element of a rows x cols block.
+ * Printed with the result so big runs can be checked against each other.
+ */
+checksum sum_matrix(const int rows, const int cols, const gemm_acc* const C) {
+    checksum sum = 0;
+    for (size_t i = 0; i < (size_t)rows * cols; i++) {
+        sum += C[i];
+    }
+    return sum;
+}
+
+/**
+ * Print the result matrix C if it's small enough, and its checksum.
+ */
+void print_result(const int NRA, const int NCB, const gemm_acc (* const C)[NCB]) {
+    if (NRA <= PRINT_MAX && NCB <= PRINT_MAX) {
+        printf ("\n");
+        printf("******************************************************\n");
+        printf("Result Matrix:\n");
+        for (int i=0; i<NRA; i++)
+            {
+                printf("\n"); 
+                for (int j=0; j<NCB; j++) 
+                    printf("%" GEMM_ACC_FMT "\t", C[i][j]);
+            }
+        printf("\n******************************************************\n");
+    }
+
+    printf("Checksum of C: " CHECKSUM_FORMAT "\n", sum_matrix(NRA, NCB, &C[0][0]));
+}
+
+/**
+ * Split NRA rows as evenly as possible over `parts` tasks.
+ * The first NRA % parts tasks get one extra row.
+ */
+void split_rows(const int NRA, const int parts, const int part, int* const offset, int* const rows) {
+    const int averow = NRA / parts;
+    const int extra = NRA % parts;
+
+    *rows = (part < extra) ? averow + 1 : averow;
+    *offset = part * averow + (part < extra ? part : extra);
+}
+
+/**
+ * Which of `parts` tasks owns `index` under split_rows().
+ * Also returns that task's offset and row count.
+ */
+int owner_of(const int total, const int parts, const int index, int* const offset, int* const rows) {
+    *offset = *rows = 0;
+    for (int part = 0; part < parts; part++) {
+        split_rows(total, parts, part, offset, rows);
+        if (index < *offset + *rows) {
+            return part;
+        }
+    }
+    return -1;
+}
+
+/**************************** point-to-point ************************************/
+/**
+ * Original master/worker scheme: the master sends each worker its slab of A
+ * and all of B, then receives the slabs of C back in rank order.
+ */
+void run_p2p(const int NRA, const int NCA, const int NCB) {
+    int	numtasks,            /* number of tasks in partition */
+    taskid,                /* a task identifier */
+    numworkers,            /* number of worker tasks */
+    source,                /* task id of message source */
+    dest,                  /* task id of message destination */
+    mtype,                 /* message type */
+    rows,                  /* rows of matrix A sent to each worker */
+    offset,                /* used to determine rows sent to each worker */
+    i, rc = 1;             /* misc */
+    const int NRB = NCA;
+    MPI_Status status;
+
+    //clock_t begin, end;
+    struct timespec begin, end;
+    double time_spent;
+
+    MPI_Comm_rank(MPI_COMM_WORLD,&taskid);
+    MPI_Comm_size(MPI_COMM_WORLD,&numtasks);
+    if (numtasks < 2 ) {
+        printf("Need at least two MPI tasks. Quitting...\n");
+        MPI_Abort(MPI_COMM_WORLD, rc);
+        exit(1);
+    }
+    numworkers = numtasks-1;
+
+    /**************************** master task ************************************/
+    if (taskid == MASTER)
+    {
+        double* worker_elapsed_times = malloc(numworkers * sizeof(double));
+
+        // The master holds the full matrices.
+        gemm_elem (* const A)[NCA] = alloc_matrix(NRA, NCA, sizeof(gemm_elem), "A");
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_acc (* const C)[NCB] = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C");
+
+        init_matrices(NRA, NCA, NCB, A, B);
+
+        /* Send matrix data to the worker tasks */
+        mtype = FROM_MASTER;
+
+        //begin = clock();
+        begin = now();
+
+        for (dest=1; dest<=numworkers; dest++)
+            {
+                split_rows(NRA, numworkers, dest - 1, &offset, &rows);
+                printf("Sending %d rows to task %d offset=%d\n",rows,dest,offset);
+                MPI_Send(&offset, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
+                MPI_Send(&rows, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
+                MPI_Send(&A[offset][0], rows*NCA, MPI_GEMM_ELEM, dest, mtype,
+                         MPI_COMM_WORLD);
+                MPI_Send(&B[0][0], NRB*NCB, MPI_GEMM_ELEM, dest, mtype, MPI_COMM_WORLD);         
+            }
+
+        /* Receive results from worker tasks */
+        mtype = FROM_WORKER;
+        for (i=1; i<=numworkers; i++)
+            {
+                source = i;
+                MPI_Recv(&offset, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
+                MPI_Recv(&rows, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
+                MPI_Recv(&C[offset][0], rows*NCB, MPI_GEMM_ACC, source, mtype, MPI_COMM_WORLD, &status);
+                // Receive the elapsed time from the workers.
+                MPI_Recv(&worker_elapsed_times[source - 1], 1, MPI_DOUBLE, source, mtype, MPI_COMM_WORLD, &status);
+                printf("Received results from task %d\n",source);
+            }
+
+
+        end = now();
+        time_spent = tdiff(begin, end);
+
+        /* Print results */
+        print_result(NRA, NCB, (const gemm_acc (*)[])C);
+        print_stats(numworkers, worker_elapsed_times, time_spent);
+
+        free(A);
+        free(B);
+        free(C);
+        free(worker_elapsed_times);
+    }
+
+
+    /**************************** worker task ************************************/
+    if (taskid > MASTER)
+    {
+        struct timespec start, stop;
+        mtype = FROM_MASTER;
+        MPI_Recv(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
+        MPI_Recv(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
+
+        // Workers only hold their own slab of A and C (plus all of B).
+        gemm_elem (* const A)[NCA] = alloc_matrix(rows, NCA, sizeof(gemm_elem), "A slab");
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_acc (* const C)[NCB] = alloc_matrix(rows, NCB, sizeof(gemm_acc), "C slab");
+
+        MPI_Recv(&A[0][0], rows*NCA, MPI_GEMM_ELEM, MASTER, mtype, MPI_COMM_WORLD, &status);
+        MPI_Recv(&B[0][0], NRB*NCB, MPI_GEMM_ELEM, MASTER, mtype, MPI_COMM_WORLD, &status);
+
+        start = now();
+        // ------------------------------ 
+        gemm(rows, NCB, NCA, &A[0][0], NCA, &B[0][0], NCB, &C[0][0], NCB);
+        // ------------------------------ 
+        stop = now();
+
+        ttype elapsed = tdiff(start, stop);
+ 
+        mtype = FROM_WORKER;
+        MPI_Send(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
+        MPI_Send(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
+        MPI_Send(&C[0][0], rows*NCB, MPI_GEMM_ACC, MASTER, mtype, MPI_COMM_WORLD);
+        MPI_Send(&elapsed, 1, MPI_DOUBLE, MASTER, mtype, MPI_COMM_WORLD);
+
+        free(A);
+        free(B);
+        free(C);
+    }
+}
+
+/**************************** collective ************************************/
+/**
+ * Every task, the master included, computes a slab of rows.
+ * B is broadcast, and the slabs of A and C move with Scatterv/Gatherv,
+ * so distribution is O(log P) steps instead of P-1 serialized sends.
+ * The master's own slab never leaves A/C (MPI_IN_PLACE).
+ */
+void run_collective(const int NRA, const int NCA, const int NCB) {
+    int numtasks, taskid;
+    const int NRB = NCA;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &taskid);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+
+    // Everyone can work out everyone's share, so nothing needs to be sent.
+    int* const a_counts = malloc(numtasks * sizeof(int));
+    int* const a_displs = malloc(numtasks * sizeof(int));
+    int* const c_counts = malloc(numtasks * sizeof(int));
+    int* const c_displs = malloc(numtasks * sizeof(int));
+    if (a_counts == NULL || a_displs == NULL || c_counts == NULL || c_displs == NULL) {
+        printf("ERROR: Couldn't allocate sendcounts/displacements.\n");
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+
+    for (int task = 0; task < numtasks; task++) {
+        int offset, rows;
+        split_rows(NRA, numtasks, task, &offset, &rows);
+        a_counts[task] = rows * NCA;
+        a_displs[task] = offset * NCA;
+        c_counts[task] = rows * NCB;
+        c_displs[task] = offset * NCB;
+    }
+    const int rows = a_counts[taskid] / NCA;
+
+    // The master holds the full A and C; its slab is the first `rows` rows.
+    // Everyone else only holds their own slab.
+    gemm_elem (* const A)[NCA] = alloc_matrix(taskid == MASTER ? NRA : rows, NCA, sizeof(gemm_elem), "A");
+    gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+    gemm_acc (* const C)[NCB] = alloc_matrix(taskid == MASTER ? NRA : rows, NCB, sizeof(gemm_acc), "C");
+
+    if (taskid == MASTER) {
+        init_matrices(NRA, NCA, NCB, A, B);
+    }
+
+    const struct timespec begin = now();
+
+    MPI_Bcast(&B[0][0], NRB * NCB, MPI_GEMM_ELEM, MASTER, MPI_COMM_WORLD);
+    MPI_Scatterv(
+        &A[0][0], a_counts, a_displs, MPI_GEMM_ELEM,
+        taskid == MASTER ? MPI_IN_PLACE : &A[0][0], a_counts[taskid], MPI_GEMM_ELEM,
+        MASTER, MPI_COMM_WORLD
+    );
+
+    const struct timespec start = now();
+    gemm(rows, NCB, NCA, &A[0][0], NCA, &B[0][0], NCB, &C[0][0], NCB);
+    const struct timespec stop = now();
+    const double elapsed = tdiff(start, stop);
+
+    MPI_Gatherv(
+        taskid == MASTER ? MPI_IN_PLACE : &C[0][0], c_counts[taskid], MPI_GEMM_ACC,
+        &C[0][0], c_counts, c_displs, MPI_GEMM_ACC,
+        MASTER, MPI_COMM_WORLD
+    );
+
+    const struct timespec end = now();
+
+    double* const elapsed_times = taskid == MASTER ? malloc(numtasks * sizeof(double)) : NULL;
+    MPI_Gather(&elapsed, 1, MPI_DOUBLE, elapsed_times, 1, MPI_DOUBLE, MASTER, MPI_COMM_WORLD);
+
+    if (taskid == MASTER) {
+        print_result(NRA, NCB, (const gemm_acc (*)[])C);
+        print_stats(numtasks, elapsed_times, tdiff(begin, end));
+        free(elapsed_times);
+    }
+
+    free(A);
+    free(B);
+    free(C);
+    free(a_counts);
+    free(a_displs);
+    free(c_counts);
+    free(c_displs);
+}
+
+/**************************** pipelined ************************************/
+/**
+ * Master/worker like p2p, but each worker's rows travel in chunks of
+ * PIPELINE_CHUNK rows with nonblocking sends and receives.
+ *
+ * Workers double-buffer: while chunk k is being multiplied, chunk k+1 of A
+ * is arriving and chunk k-1 of C is on its way back. The master posts every
+ * send and receive up front and waits on all of them at once, so results
+ * are taken in whatever order the workers finish.
+ *
+ * Messages between a pair of tasks share a tag and are matched in the order
+ * the receives were posted (MPI never lets them overtake each other).
+ */
+void run_pipeline(const int NRA, const int NCA, const int NCB) {
+    int numtasks, taskid, rc = 1;
+    const int NRB = NCA;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &taskid);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+    if (numtasks < 2 ) {
+        printf("Need at least two MPI tasks. Quitting...\n");
+        MPI_Abort(MPI_COMM_WORLD, rc);
+        exit(1);
+    }
+    const int numworkers = numtasks - 1;
+
+    /**************************** master task ************************************/
+    if (taskid == MASTER)
+    {
+        double* const worker_elapsed_times = malloc(numworkers * sizeof(double));
+
+        gemm_elem (* const A)[NCA] = alloc_matrix(NRA, NCA, sizeof(gemm_elem), "A");
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_acc (* const C)[NCB] = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C");
+
+        init_matrices(NRA, NCA, NCB, A, B);
+
+        // Per worker: B, every A chunk, every C chunk, and the elapsed time.
+        const int max_chunks = (NRA / numworkers + 1 + PIPELINE_CHUNK - 1) / PIPELINE_CHUNK;
+        MPI_Request* const requests = malloc((size_t)numworkers * (2 * max_chunks + 2) * sizeof(MPI_Request));
+        if (worker_elapsed_times == NULL || requests == NULL) {
+            printf("ERROR: Couldn't allocate requests.\n");
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+        int num_requests = 0;
+
+        const struct timespec begin = now();
+
+        for (int dest = 1; dest <= numworkers; dest++) {
+            int offset, rows;
+            split_rows(NRA, numworkers, dest - 1, &offset, &rows);
+            printf("Sending %d rows to task %d offset=%d\n", rows, dest, offset);
+
+            MPI_Isend(&B[0][0], NRB * NCB, MPI_GEMM_ELEM, dest, FROM_MASTER, MPI_COMM_WORLD, &requests[num_requests++]);
+
+            for (int first = 0; first < rows; first += PIPELINE_CHUNK) {
+                const int chunk_rows = GEMM_MIN(PIPELINE_CHUNK, rows - first);
+                MPI_Isend(&A[offset + first][0], chunk_rows * NCA, MPI_GEMM_ELEM, dest, FROM_MASTER,
+                          MPI_COMM_WORLD, &requests[num_requests++]);
+                MPI_Irecv(&C[offset + first][0], chunk_rows * NCB, MPI_GEMM_ACC, dest, FROM_WORKER,
+                          MPI_COMM_WORLD, &requests[num_requests++]);
+            }
+
+            MPI_Irecv(&worker_elapsed_times[dest - 1], 1, MPI_DOUBLE, dest, FROM_WORKER,
+                      MPI_COMM_WORLD, &requests[num_requests++]);
+        }
+
+        MPI_Waitall(num_requests, requests, MPI_STATUSES_IGNORE);
+
+        const struct timespec end = now();
+
+        print_result(NRA, NCB, (const gemm_acc (*)[])C);
+        print_stats(numworkers, worker_elapsed_times, tdiff(begin, end));
+
+        free(A);
+        free(B);
+        free(C);
+        free(requests);
+        free(worker_elapsed_times);
+    }
+
+    /**************************** worker task ************************************/
+    if (taskid > MASTER)
+    {
+        // The split is deterministic, so the offset/rows messages aren't needed.
+        int offset, rows;
+        split_rows(NRA, numworkers, taskid - 1, &offset, &rows);
+        const int num_chunks = (rows + PIPELINE_CHUNK - 1) / PIPELINE_CHUNK;
+
+        // Two chunk buffers each for A and C.
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_elem* a_chunk[2];
+        gemm_acc* c_chunk[2];
+        for (int i = 0; i < 2; i++) {
+            a_chunk[i] = alloc_matrix(PIPELINE_CHUNK, NCA, sizeof(gemm_elem), "A chunk");
+            c_chunk[i] = alloc_matrix(PIPELINE_CHUNK, NCB, sizeof(gemm_acc), "C chunk");
+        }
+        MPI_Request b_request;
+        MPI_Request a_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        MPI_Request c_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+
+        MPI_Irecv(&B[0][0], NRB * NCB, MPI_GEMM_ELEM, MASTER, FROM_MASTER, MPI_COMM_WORLD, &b_request);
+        if (num_chunks > 0) {
+            MPI_Irecv(a_chunk[0], GEMM_MIN(PIPELINE_CHUNK, rows) * NCA, MPI_GEMM_ELEM, MASTER, FROM_MASTER,
+                      MPI_COMM_WORLD, &a_request[0]);
+        }
+        MPI_Wait(&b_request, MPI_STATUS_IGNORE);
+
+        double elapsed = 0;
+
+        for (int chunk = 0; chunk < num_chunks; chunk++) {
+            const int cur = chunk % 2;
+            const int next = 1 - cur;
+            const int chunk_rows = GEMM_MIN(PIPELINE_CHUNK, rows - chunk * PIPELINE_CHUNK);
+
+            // Start pulling in the next chunk. Its buffer held chunk-1, which is done.
+            if (chunk + 1 < num_chunks) {
+                const int next_rows = GEMM_MIN(PIPELINE_CHUNK, rows - (chunk + 1) * PIPELINE_CHUNK);
+                MPI_Irecv(a_chunk[next], next_rows * NCA, MPI_GEMM_ELEM, MASTER, FROM_MASTER,
+                          MPI_COMM_WORLD, &a_request[next]);
+            }
+
+            // This chunk's A must have arrived, and chunk-2's C must be gone
+            // before its buffer gets overwritten.
+            MPI_Wait(&a_request[cur], MPI_STATUS_IGNORE);
+            MPI_Wait(&c_request[cur], MPI_STATUS_IGNORE);
+
+            const struct timespec start = now();
+            gemm(chunk_rows, NCB, NCA, a_chunk[cur], NCA, &B[0][0], NCB, c_chunk[cur], NCB);
+            elapsed += tdiff(start, now());
+
+            MPI_Isend(c_chunk[cur], chunk_rows * NCB, MPI_GEMM_ACC, MASTER, FROM_WORKER,
+                      MPI_COMM_WORLD, &c_request[cur]);
+        }
+
+        MPI_Waitall(2, c_request, MPI_STATUSES_IGNORE);
+        MPI_Send(&elapsed, 1, MPI_DOUBLE, MASTER, FROM_WORKER, MPI_COMM_WORLD);
+
+        free(B);
+        for (int i = 0; i < 2; i++) {
+            free(a_chunk[i]);
+            free(c_chunk[i]);
+        }
+    }
+}
+
+/**************************** dynamic ************************************/
+/**
+ * Size of the next chunk for a worker in dynamic mode.
+ *
+ * Guided self-scheduling weighted by speed: the worker gets half of its
+ * fair share of the remaining rows, where its share is its measured rows/s
+ * over the sum for all workers. Chunks start big and shrink as the work
+ * runs out, so a slow worker can't be stuck holding a large chunk at the end.
+ * Never smaller than DYNAMIC_CHUNK (except for the very last rows).
+ */
+int next_chunk_size(const int remaining, const double my_rate, const double total_rate) {
+    int chunk = (int)(remaining * (my_rate / total_rate) / 2);
+    chunk = chunk < DYNAMIC_CHUNK ? DYNAMIC_CHUNK : chunk;
+    return GEMM_MIN(chunk, remaining);
+}
+
+/**
+ * Worker w's rows/s and the sum for all workers, for next_chunk_size().
+ * worker_rate is indexed by rank; 0 means not measured yet. Such workers
+ * count as the mean of the measured ones (or all as 1 before any is), so
+ * their guess is in the same units as the measurements it's added to.
+ */
+void worker_share(const double* const worker_rate, const int numworkers, const int w,
+                  double* const my_rate, double* const total_rate) {
+    double measured_rate = 0;
+    int measured = 0;
+    for (int v = 1; v <= numworkers; v++) {
+        if (worker_rate[v] > 0) {
+            measured_rate += worker_rate[v];
+            measured++;
+        }
+    }
+
+    const double mean = (measured > 0) ? measured_rate / measured : 1;
+    *my_rate = (worker_rate[w] > 0) ? worker_rate[w] : mean;
+    *total_rate = measured_rate + (numworkers - measured) * mean;
+}
+
+/**
+ * Hand rows [offset, offset + rows) of A to a worker.
+ * rows == 0 tells the worker to stop.
+ */
+void send_chunk(const int worker, const int offset, const int rows, const int NCA, const gemm_elem (* const A)[NCA]) {
+    const int header[2] = {offset, rows};
+    MPI_Send(header, 2, MPI_INT, worker, FROM_MASTER, MPI_COMM_WORLD);
+    if (rows > 0) {
+        MPI_Send(&A[offset][0], rows * NCA, MPI_GEMM_ELEM, worker, FROM_MASTER, MPI_COMM_WORLD);
+    }
+}
+
+/**
+ * Master/worker with dynamic load balancing.
+ *
+ * B is broadcast once. Each worker then holds one chunk of rows at a time:
+ * when it returns a chunk of C (with the time it took), the master hands it
+ * the next one, sized by next_chunk_size() from the worker's measured
+ * throughput. A slow or oversubscribed node simply ends up doing fewer rows.
+ *
+ * Master -> worker: {offset, rows} then the rows of A. rows == 0 means stop.
+ * Worker -> master: {offset, rows}, the rows of C, then the compute time.
+ */
+void run_dynamic(const int NRA, const int NCA, const int NCB) {
+    int numtasks, taskid, rc = 1;
+    const int NRB = NCA;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &taskid);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+    if (numtasks < 2 ) {
+        printf("Need at least two MPI tasks. Quitting...\n");
+        MPI_Abort(MPI_COMM_WORLD, rc);
+        exit(1);
+    }
+    const int numworkers = numtasks - 1;
+
+    /**************************** master task ************************************/
+    if (taskid == MASTER)
+    {
+        gemm_elem (* const A)[NCA] = alloc_matrix(NRA, NCA, sizeof(gemm_elem), "A");
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_acc (* const C)[NCB] = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C");
+
+        init_matrices(NRA, NCA, NCB, A, B);
+
+        // Per-worker bookkeeping, indexed by rank (entry 0 is unused).
+        double* const worker_elapsed_times = calloc(numtasks, sizeof(double));
+        double* const worker_rate = calloc(numtasks, sizeof(double));
+        int* const worker_rows = calloc(numtasks, sizeof(int));
+        int* const worker_chunks = calloc(numtasks, sizeof(int));
+        if (worker_elapsed_times == NULL || worker_rate == NULL || worker_rows == NULL || worker_chunks == NULL) {
+            printf("ERROR: Couldn't allocate worker stats.\n");
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+
+        const struct timespec begin = now();
+
+        MPI_Bcast(&B[0][0], NRB * NCB, MPI_GEMM_ELEM, MASTER, MPI_COMM_WORLD);
+
+        int next_row = 0;
+        int active = 0;
+
+        for (int w = 1; w <= numworkers; w++) {
+            double my_rate, total_rate;
+            worker_share(worker_rate, numworkers, w, &my_rate, &total_rate);
+            const int rows = next_chunk_size(NRA - next_row, my_rate, total_rate);
+            send_chunk(w, next_row, rows, NCA, (const gemm_elem (*)[])A);
+            next_row += rows;
+            active += rows > 0;
+        }
+
+        while (active > 0) {
+            int header[2];
+            double elapsed;
+            MPI_Status status;
+
+            // Take results from whoever finishes first.
+            MPI_Recv(header, 2, MPI_INT, MPI_ANY_SOURCE, FROM_WORKER, MPI_COMM_WORLD, &status);
+            const int w = status.MPI_SOURCE;
+            MPI_Recv(&C[header[0]][0], header[1] * NCB, MPI_GEMM_ACC, w, FROM_WORKER, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Recv(&elapsed, 1, MPI_DOUBLE, w, FROM_WORKER, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            active--;
+
+            worker_elapsed_times[w] += elapsed;
+            worker_rows[w] += header[1];
+            worker_chunks[w]++;
+
+            // Update this worker's throughput (rows per second so far).
+            if (worker_elapsed_times[w] > 0) {
+                worker_rate[w] = worker_rows[w] / worker_elapsed_times[w];
+            }
+
+            double my_rate, total_rate;
+            worker_share(worker_rate, numworkers, w, &my_rate, &total_rate);
+            const int rows = next_chunk_size(NRA - next_row, my_rate, total_rate);
+            send_chunk(w, next_row, rows, NCA, (const gemm_elem (*)[])A);
+            next_row += rows;
+            active += rows > 0;
+        }
+
+        const struct timespec end = now();
+
+        print_result(NRA, NCB, (const gemm_acc (*)[])C);
+        for (int w = 1; w <= numworkers; w++) {
+            printf("Worker %d: %d rows in %d chunks\n", w - 1, worker_rows[w], worker_chunks[w]);
+        }
+        print_stats(numworkers, &worker_elapsed_times[1], tdiff(begin, end));
+
+        free(A);
+        free(B);
+        free(C);
+        free(worker_elapsed_times);
+        free(worker_rate);
+        free(worker_rows);
+        free(worker_chunks);
+    }
+
+    /**************************** worker task ************************************/
+    if (taskid > MASTER)
+    {
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        MPI_Bcast(&B[0][0], NRB * NCB, MPI_GEMM_ELEM, MASTER, MPI_COMM_WORLD);
+
+        // Chunk sizes vary, so grow the buffers as needed.
+        int capacity = 0;
+        gemm_elem* a_chunk = NULL;
+        gemm_acc* c_chunk = NULL;
+
+        while (1) {
+            int header[2];
+            MPI_Recv(header, 2, MPI_INT, MASTER, FROM_MASTER, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            const int rows = header[1];
+            if (rows == 0) {
+                break;
+            }
+
+            if (rows > capacity) {
+                free(a_chunk);
+                free(c_chunk);
+                capacity = rows;
+                a_chunk = alloc_matrix(capacity, NCA, sizeof(gemm_elem), "A chunk");
+                c_chunk = alloc_matrix(capacity, NCB, sizeof(gemm_acc), "C chunk");
+            }
+
+            MPI_Recv(a_chunk, rows * NCA, MPI_GEMM_ELEM, MASTER, FROM_MASTER, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            const struct timespec start = now();
+            gemm(rows, NCB, NCA, a_chunk, NCA, &B[0][0], NCB, c_chunk, NCB);
+            const double elapsed = tdiff(start, now());
+
+            MPI_Send(header, 2, MPI_INT, MASTER, FROM_WORKER, MPI_COMM_WORLD);
+            MPI_Send(c_chunk, rows * NCB, MPI_GEMM_ACC, MASTER, FROM_WORKER, MPI_COMM_WORLD);
+            MPI_Send(&elapsed, 1, MPI_DOUBLE, MASTER, FROM_WORKER, MPI_COMM_WORLD);
+        }
+
+        free(a_chunk);
+        free(c_chunk);
+        free(B);
+    }
+}
+
+/**************************** SUMMA ************************************/
+/**
+ * Scalable Universal Matrix Multiply on a 2D process grid.
+ *
+ * The tasks form a pr x pc Cartesian grid. Task (r, c) owns
+ *   - block (r, c) of A: rows split over grid rows, cols (k) split over grid cols,
+ *   - block (r, c) of B: rows (k) split over grid rows, cols split over grid cols,
+ *   - block (r, c) of C.
+ * Each step takes the next k panel (at most SUMMA_PANEL wide): its owner in
+ * every grid row broadcasts the A panel along the row, its owner in every
+ * grid column broadcasts the B panel down the column, and everyone adds
+ * A_panel * B_panel into their C block.
+ *
+ * Nothing is ever held whole: each task generates its own blocks of A and B,
+ * so memory per task is O(N^2 / P) plus two panels.
+ */
+void run_summa(const int NRA, const int NCA, const int NCB) {
+    int numtasks, taskid;
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+
+    // Let MPI pick a grid as close to square as possible.
+    int dims[2] = {0, 0};
+    int periods[2] = {0, 0};
+    MPI_Dims_create(numtasks, 2, dims);
+
+    MPI_Comm grid_comm, row_comm, col_comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid_comm);
+    MPI_Comm_rank(grid_comm, &taskid);
+
+    int coords[2];
+    MPI_Cart_coords(grid_comm, taskid, 2, coords);
+    const int prow = coords[0];
+    const int pcol = coords[1];
+
+    // row_comm: everyone in my grid row, ranked by grid column.
+    // col_comm: everyone in my grid column, ranked by grid row.
+    const int keep_cols[2] = {0, 1};
+    const int keep_rows[2] = {1, 0};
+    MPI_Cart_sub(grid_comm, keep_cols, &row_comm);
+    MPI_Cart_sub(grid_comm, keep_rows, &col_comm);
+
+    // My block of C.
+    int row_off, my_rows, col_off, my_cols;
+    split_rows(NRA, dims[0], prow, &row_off, &my_rows);
+    split_rows(NCB, dims[1], pcol, &col_off, &my_cols);
+
+    // K is split over grid columns for A and over grid rows for B.
+    int a_k_off, a_k_len, b_k_off, b_k_len;
+    split_rows(NCA, dims[1], pcol, &a_k_off, &a_k_len);
+    split_rows(NCA, dims[0], prow, &b_k_off, &b_k_len);
+
+    // Blocks can be empty on tiny problems, so these are flat
+    // (a gemm_elem (*)[0] VLA pointer isn't allowed).
+    gemm_elem* const A = alloc_matrix(my_rows, a_k_len, sizeof(gemm_elem), "A block");
+    gemm_elem* const B = alloc_matrix(b_k_len, my_cols, sizeof(gemm_elem), "B block");
+    gemm_acc* const C = alloc_matrix(my_rows, my_cols, sizeof(gemm_acc), "C block");
+    gemm_elem* const a_panel = alloc_matrix(my_rows, SUMMA_PANEL, sizeof(gemm_elem), "A panel");
+    gemm_elem* const b_panel = alloc_matrix(SUMMA_PANEL, my_cols, sizeof(gemm_elem), "B panel");
+
+    if (taskid == MASTER) {
+        printf("Process grid: %d x %d, panel width %d\n", dims[0], dims[1], SUMMA_PANEL);
+    }
+
+    // Same contents as init_matrices(), generated in place.
+    for (int i = 0; i < my_rows; i++)
+        for (int j = 0; j < a_k_len; j++)
+            A[i * a_k_len + j] = (row_off + i) + (a_k_off + j);
+    for (int i = 0; i < b_k_len; i++)
+        for (int j = 0; j < my_cols; j++)
+            B[i * my_cols + j] = (b_k_off + i) - (col_off + j);
+    memset(C, 0, (size_t)my_rows * my_cols * sizeof(gemm_acc));
+
+    double compute_time = 0;
+    MPI_Barrier(grid_comm);
+    const struct timespec begin = now();
+
+    for (int k = 0; k < NCA; ) {
+        // Who owns this k in my grid row (for A) and grid column (for B)?
+        // The panel can't run past the end of either owner's block.
+        int a_owner_off, a_owner_len, b_owner_off, b_owner_len;
+        const int a_owner = owner_of(NCA, dims[1], k, &a_owner_off, &a_owner_len);
+        const int b_owner = owner_of(NCA, dims[0], k, &b_owner_off, &b_owner_len);
+
+        int width = SUMMA_PANEL;
+        width = GEMM_MIN(width, a_owner_off + a_owner_len - k);
+        width = GEMM_MIN(width, b_owner_off + b_owner_len - k);
+
+        // A panel: my_rows x width, strided in the owner's block, so pack it.
+        if (pcol == a_owner) {
+            for (int i = 0; i < my_rows; i++) {
+                memcpy(&a_panel[i * width], &A[i * a_k_len + (k - a_k_off)], width * sizeof(gemm_elem));
+            }
+        }
+        MPI_Bcast(a_panel, my_rows * width, MPI_GEMM_ELEM, a_owner, row_comm);
+
+        // B panel: width x my_cols, already contiguous in the owner's block.
+        gemm_elem* const b_src = (prow == b_owner) ? &B[(k - b_k_off) * my_cols] : b_panel;
+        MPI_Bcast(b_src, width * my_cols, MPI_GEMM_ELEM, b_owner, col_comm);
+
+        const struct timespec start = now();
+        gemm_accumulate(my_rows, my_cols, width, a_panel, width, b_src, my_cols, C, my_cols);
+        compute_time += tdiff(start, now());
+
+        k += width;
+    }
+
+    const struct timespec end = now();
+
+    double* const elapsed_times = taskid == MASTER ? malloc(numtasks * sizeof(double)) : NULL;
+    MPI_Gather(&compute_time, 1, MPI_DOUBLE, elapsed_times, 1, MPI_DOUBLE, MASTER, grid_comm);
+
+    if (NRA <= PRINT_MAX && NCB <= PRINT_MAX) {
+        // Small enough to print: collect the blocks on the master.
+        if (taskid == MASTER) {
+            gemm_acc (* const C_full)[NCB] = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C");
+            gemm_acc* const block = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C block");
+
+            for (int task = 0; task < numtasks; task++) {
+                int task_coords[2], r_off, r_len, c_off, c_len;
+                MPI_Cart_coords(grid_comm, task, 2, task_coords);
+                split_rows(NRA, dims[0], task_coords[0], &r_off, &r_len);
+                split_rows(NCB, dims[1], task_coords[1], &c_off, &c_len);
+
+                if (task == MASTER) {
+                    memcpy(block, C, (size_t)r_len * c_len * sizeof(gemm_acc));
+                }
+                else {
+                    MPI_Recv(block, r_len * c_len, MPI_GEMM_ACC, task, FROM_WORKER, grid_comm, MPI_STATUS_IGNORE);
+                }
+
+                for (int i = 0; i < r_len; i++)
+                    memcpy(&C_full[r_off + i][c_off], &block[i * c_len], c_len * sizeof(gemm_acc));
+            }
+
+            print_result(NRA, NCB, (const gemm_acc (*)[])C_full);
+            free(C_full);
+            free(block);
+        }
+        else {
+            MPI_Send(C, my_rows * my_cols, MPI_GEMM_ACC, MASTER, FROM_WORKER, grid_comm);
+        }
+    }
+    else {
+        const checksum my_sum = sum_matrix(my_rows, my_cols, C);
+        checksum sum = 0;
+        MPI_Reduce(&my_sum, &sum, 1, MPI_CHECKSUM, MPI_SUM, MASTER, grid_comm);
+        if (taskid == MASTER) {
+            printf("Checksum of C: " CHECKSUM_FORMAT "\n", sum);
+        }
+    }
+
+    if (taskid == MASTER) {
+        print_stats(numtasks, elapsed_times, tdiff(begin, end));
+        free(elapsed_times);
+    }
+
+    free(A);
+    free(B);
+    free(C);
+    free(a_panel);
+    free(b_panel);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&col_comm);
+    MPI_Comm_free(&grid_comm);
+}
+
+int main (int argc, char *argv[])
+{
+    int numtasks, taskid;
+
+    MPI_Init(&argc,&argv);
+    MPI_Comm_rank(MPI_COMM_WORLD,&taskid);
+    MPI_Comm_size(MPI_COMM_WORLD,&numtasks);
+
+    // Default to the original point-to-point scheme.
+    enum mode mode = MODE_P2P;
+    if (argc == 4 + 1) {
+        for (mode = 0; mode < NUM_MODES; mode++) {
+            if (strcmp(argv[4], mode_names[mode]) == 0) {
+                break;
+            }
+        }
+    }
+
+    if ((argc != 3 + 1 && argc != 4 + 1) || mode == NUM_MODES) {
+        if (taskid == MASTER) {
+            printf("Usage: ./mat_mult <rows in A> <cols in A/rows in B> <cols in B> [mode]\n");
+            printf("Modes:");
+            for (int m = 0; m < NUM_MODES; m++) {
+                printf(" %s", mode_names[m]);
+            }
+            printf("\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Every rank gets the same command line, so no need to send these.
+    const int NRA = atof(argv[1]);   /* number of rows in matrix A */
+    const int NCA = atof(argv[2]);   /* number of columns in matrix A */
+    const int NCB = atof(argv[3]);   /* number of columns in matrix B */
+
+    if (NRA <= 0 || NCA <= 0 || NCB <= 0) {
+        if (taskid == MASTER) {
+            printf("Matrix dimensions must be positive.\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (taskid == MASTER) {
+        printf("mpi_mm has started with %d tasks (%s mode).\n", numtasks, mode_names[mode]);
+        printf("Matrix A: #rows %d; #cols %d\n", NRA, NCA);
+        printf("Matrix B: #rows %d; #cols %d\n", NCA, NCB);
+        printf("Elements: %s (%s kernel)\n", GEMM_TYPE_NAME, GEMM_ISA);
+        printf ("\n");
+    }
+
+    switch (mode) {
+    case MODE_P2P:
+        run_p2p(NRA, NCA, NCB);
+        break;
+    case MODE_COLLECTIVE:
+        run_collective(NRA, NCA, NCB);
+        break;
+    case MODE_SUMMA:
+        run_summa(NRA, NCA, NCB);
+        break;
+    case MODE_PIPELINE:
+        run_pipeline(NRA, NCA, NCB);
+        break;
+    case MODE_DYNAMIC:
+        run_dynamic(NRA, NCA, NCB);
+        break;
+    default:
+        break;
+    }
+
+    MPI_Finalize();
+    return 0;
+}
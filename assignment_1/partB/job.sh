@@ -5,12 +5,13 @@
 #SBATCH --account=eel6763
 #SBATCH --qos=eel6763
 #SBATCH --nodes=2
-#SBATCH --ntasks=32
-#SBATCH --ntasks-per-node=16
-#SBATCH --cpus-per-task=1
+#SBATCH --ntasks=4
+#SBATCH --ntasks-per-node=2
+#SBATCH --cpus-per-task=8
 #SBATCH --mem-per-cpu=1000mb
 #SBATCH -t 00:01:00
-#SBATCH -o SendRecvR32N10k
+#SBATCH -o SendRecvR4T8N10k
 #SBATCH -e myerr
+export OMP_NUM_THREADS=$SLURM_CPUS_PER_TASK
 srun --mpi=pmix_v3 ./monte_carlo -10 10 10000
 
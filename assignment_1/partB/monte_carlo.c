@@ -3,6 +3,11 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <omp.h>
+#include "kahan.h"
+#include "philox.h"
+#include "simd_exp.h"
 
 //------------------------------
 // MPI constants
@@ -11,6 +16,13 @@ const int MASTER = 0; // taskid of first task
 const int FROM_MASTER = 1; // message types
 const int FROM_WORKER = 2;
 
+// Philox key. Every rank uses the same one and draws from its own
+// range of sample indices, so results don't depend on the rank count.
+const uint64_t RNG_SEED = 2023;
+
+// 8 * sqrt(2 * pi), the constant factor of f(x).
+const double F_SCALE = 20.053026197048002;
+
 // Choose whether to include debug features and logging.
 // #define DEBUG
 
@@ -24,17 +36,17 @@ const int FROM_WORKER = 2;
 //------------------------------
 // Math formulas
 //------------------------------
+#pragma omp declare simd
 double f(const double x);
-double h_x(const double, const double, const int);
+double h_x(const double, const double, const uint64_t, const long long);
 
 double map(double x, double in_min, double in_max, double out_min, double out_max); 
 
 //------------------------------
 // MPI helper functions
 //------------------------------
-void init_rand_seed(void); 
 double estimate_g(const double, const double, const long long);
-void collect_results(const double* const);
+void collect_results(const double* const, const double, const long long);
 DBG(void test_rng(const double, const double);)
 
 
@@ -50,19 +62,36 @@ struct timespec start_time, stop_time;
 int main(int argc, char* argv[]) {
     MPI_Init(&argc, &argv);
 
+    int my_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    if (argc != 3 + 1) {
+        if (my_rank == MASTER) {
+            printf("Usage: %s <lower bound> <upper bound> <number of samples>\n", argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
     // Define constants
     const double lower_bound = atof(argv[1]);
     const double upper_bound = atof(argv[2]);
+    // atof so "1e10" works; exact for any count below 2^53.
     const long long N = atof(argv[3]);
 
-    // Initialize different seeds to get better variance among workers
-    init_rand_seed();
+    if (N <= 0) {
+        if (my_rank == MASTER) {
+            printf("Number of samples must be positive.\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
 
     // Run N estimations and send them to the master.
     double result = estimate_g(lower_bound, upper_bound, N);
 
     // The master will tally up the estimations, yielding the final result.
-    collect_results(&result);
+    collect_results(&result, upper_bound - lower_bound, N);
 
     MPI_Finalize();
     return 0;
@@ -74,25 +103,61 @@ int main(int argc, char* argv[]) {
 //------------------------------
 /**
  * The formula to be integrated.
+ * 8 * sqrt(2 * pi) / exp((2x)^2), with the constant folded and the
+ * pow/divide turned into one vectorizable exp(-4x^2).
  */
 double f(double x) {
-    return 8 * sqrt(2 * M_PI) / exp(pow(2 * x, 2));
+    return F_SCALE * simd_exp(-4 * x * x);
 }
 
+// Lets OpenMP combine per-thread compensated sums.
+#pragma omp declare reduction(kahan : kahan_sum : kahan_merge(&omp_out, &omp_in)) \
+    initializer(omp_priv = (kahan_sum){0, 0})
+
 /**
  * The monte-carlo integral.
  * Used by workers to obtain their results.
+ * first: global index of this worker's first sample.
  * n: number of iterations.
+ * Returns the sum of f over the samples; scaling to the integral
+ * happens once all ranks' sums are in (see collect_results()).
+ *
+ * The samples are split over this rank's OpenMP threads, each drawing its
+ * own slice of the sample sequence, and f is evaluated a SIMD batch at a time.
+ * Each batch's partial sum is folded into a compensated sum so that long
+ * runs don't lose precision.
  */
-double h_x(const double lower_bound, const double upper_bound, const int n) {
-    double sum = 0;
-
-    for (int i = 0; i < n; i++) {
-        double random_sample = map(rand(), 0, RAND_MAX, lower_bound, upper_bound);
-        sum += f(random_sample);
+double h_x(const double lower_bound, const double upper_bound, const uint64_t first, const long long n) {
+    const double width = upper_bound - lower_bound;
+    kahan_sum sum = {0, 0};
+
+    #pragma omp parallel reduction(kahan:sum)
+    {
+        const int num_threads = omp_get_num_threads();
+        const int thread = omp_get_thread_num();
+        const long long begin = n / num_threads * thread + (thread < n % num_threads ? thread : n % num_threads);
+        const long long end = begin + n / num_threads + (thread < n % num_threads);
+
+        philox_stream rng = philox_stream_at(RNG_SEED, first + begin);
+        double samples[PHILOX_BATCH];
+
+        // Draw uniforms a batch at a time; the bulk generator vectorizes.
+        for (long long i = begin; i < end; i += PHILOX_BATCH) {
+            const int batch = (end - i < PHILOX_BATCH) ? end - i : PHILOX_BATCH;
+            philox_fill_uniform(&rng, samples, batch);
+
+            // Same as f(map(sample, 0, 1, lower_bound, upper_bound)).
+            double batch_sum = 0;
+            #pragma omp simd reduction(+:batch_sum)
+            for (int j = 0; j < batch; j++) {
+                batch_sum += f(lower_bound + width * samples[j]);
+            }
+
+            kahan_add(&sum, batch_sum);
+        }
     }
 
-    return (upper_bound - lower_bound) / n * sum; // TODO should this only return sum, and the rest be calculated later in collect_results()?
+    return kahan_total(sum);
 }
 
 /**
@@ -105,18 +170,6 @@ double map(double x, double in_min, double in_max, double out_min, double out_ma
 //------------------------------
 // MPI helper functions
 //------------------------------
-/**
-* Initialize a random seed for this worker.
-* Use this worker's rank to seed the RNG.
-*/
-void init_rand_seed(void) {
-    int my_rank;
-    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
-    srand(my_rank);
-
-    DBG(printf("Seed initialized for rank %d.\n", my_rank));
-}
-
 DBG(
 /**
 * Print a few random numbers.
@@ -124,12 +177,12 @@ DBG(
 void test_rng(const double lower_bound, const double upper_bound) {
     for(int i = 0; i < 100; i++) {
         // Get a random number and map it to the valid range.
-        double random_num = map(rand(), 0, RAND_MAX, lower_bound, upper_bound);
+        double random_num = map(philox_uniform_at(RNG_SEED, i), 0, 1, lower_bound, upper_bound);
         printf("%f, ", random_num);
         printf("\n");
 
         // Verify it's within the allowed range.
-        // Honestly this tests `map` moreso than `rand`.
+        // Honestly this tests `map` moreso than the RNG.
         if (random_num < lower_bound || random_num > upper_bound) {
             printf("ERROR: RNG is not mapping to [%f, %f] correctly.\n", lower_bound, upper_bound);
             exit(EXIT_FAILURE);
@@ -142,13 +195,20 @@ void test_rng(const double lower_bound, const double upper_bound) {
  * Workers estimate their portion.
  */
 double estimate_g(const double lower_bound, const double upper_bound, const long long N) {
-    // Divide iterations evenly among all processes
-    int num_nodes;
+    // Divide iterations evenly among all processes.
+    // The first N % num_nodes ranks take one extra so no samples are dropped.
+    int num_nodes, my_rank;
     MPI_Comm_size(MPI_COMM_WORLD, &num_nodes);
-    const int num_iterations = N / num_nodes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    const long long extra = N % num_nodes;
+    const long long num_iterations = N / num_nodes + (my_rank < extra);
+
+    // Each rank draws its own slice of the global sample sequence.
+    const uint64_t first = (uint64_t)my_rank * (N / num_nodes) + (my_rank < extra ? my_rank : extra);
+    DBG(printf("Rank %d starts at sample %llu.\n", my_rank, (unsigned long long)first));
 
     start_time = now();
-    return h_x(lower_bound, upper_bound, num_iterations);
+    return h_x(lower_bound, upper_bound, first, num_iterations);
 }
 
 
@@ -156,8 +216,11 @@ double estimate_g(const double lower_bound, const double upper_bound, const long
 * The workers send their results to the master.
 * Master collects the results of each worker and sums 
 * them together.
+* result: this rank's sum of f over its samples.
+* width: upper_bound - lower_bound.
+* N: total number of samples over all ranks.
 */
-void collect_results(const double* const result) {
+void collect_results(const double* const result, const double width, const long long N) {
     int my_rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
 
@@ -166,21 +229,23 @@ void collect_results(const double* const result) {
         int num_nodes;
         MPI_Comm_size(MPI_COMM_WORLD, &num_nodes);
 
-        double sum = *result;
+        kahan_sum total = {*result, 0};
 
         for (int i = 1; i < num_nodes; i++) {
             double worker_result;
             MPI_Recv(&worker_result, 1, MPI_DOUBLE, i, FROM_WORKER, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
-            sum += worker_result;
+            kahan_add(&total, worker_result);
         }
 
-        // To take the mean, divide by num_nodes
-        sum /= num_nodes;
+        // Ranks may have done different numbers of samples, so scale the
+        // grand total rather than averaging the per-rank estimates.
+        const double sum = width / N * kahan_total(total);
 
         stop_time = now();
 
         // print stats
+        printf("Ranks: %d, threads per rank: %d, samples: %lld\n", num_nodes, omp_get_max_threads(), N);
         printf("Approximation: %f\n", sum);
 
         const double elapsed_time = tdiff(start_time, stop_time);
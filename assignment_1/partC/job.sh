@@ -5,11 +5,13 @@
 #SBATCH --account=eel6763
 #SBATCH --qos=eel6763
 #SBATCH --nodes=2
-#SBATCH --ntasks=32
-#SBATCH --ntasks-per-node=16
-#SBATCH --cpus-per-task=1
+#SBATCH --ntasks=4
+#SBATCH --ntasks-per-node=2
+#SBATCH --cpus-per-task=8
 #SBATCH --mem-per-cpu=1000mb
 #SBATCH -t 00:01:00
-#SBATCH -o ReduceR32N100k
+#SBATCH -o ReduceR4T8N100k
 #SBATCH -e myerr
+export OMP_NUM_THREADS=$SLURM_CPUS_PER_TASK
+#(lower, upper, samples, [tolerance, [sampler: uniform | stratified | importance]])
 srun --mpi=pmix_v3 ./monte_carlo_reduce -10 10 100000
@@ -1,8 +1,14 @@
 #include "mpi.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <omp.h>
+#include "kahan.h"
+#include "philox.h"
+#include "simd_exp.h"
 
 //------------------------------
 // MPI constants
@@ -11,6 +17,64 @@ const int MASTER = 0; // taskid of first task
 const int FROM_MASTER = 1; // message types
 const int FROM_WORKER = 2;
 
+// Philox key. Every rank uses the same one and draws from its own
+// range of sample indices, so results don't depend on the rank count.
+const uint64_t RNG_SEED = 2023;
+
+// 8 * sqrt(2 * pi), the constant factor of f(x).
+const double F_SCALE = 20.053026197048002;
+
+//------------------------------
+// Adaptive mode
+//------------------------------
+// Samples per round, over all ranks. After every round the ranks combine
+// their partial sums and stop once the confidence interval is tight enough.
+#ifndef ADAPTIVE_ROUND
+#define ADAPTIVE_ROUND 1048576
+#endif
+
+// Equal-width strata used by the stratified sampler.
+#ifndef STRATA
+#define STRATA 16
+#endif
+
+// z value of the reported confidence interval (1.96 -> 95%).
+#ifndef CONFIDENCE_Z
+#define CONFIDENCE_Z 1.96
+#endif
+
+// The importance sampler draws from a Cauchy density centered here.
+// f is a Gaussian bump at 0 with std 1/(2*sqrt(2)) ~ 0.35; the Cauchy's
+// heavier tails keep f/p bounded over the whole range.
+#ifndef IMPORTANCE_CENTER
+#define IMPORTANCE_CENTER 0.0
+#endif
+#ifndef IMPORTANCE_SCALE
+#define IMPORTANCE_SCALE 0.5
+#endif
+
+// Per stratum we track the sum, the sum of squares and the sample count.
+#define MOMENTS 3
+
+enum sampler_kind {
+    SAMPLER_UNIFORM,
+    SAMPLER_STRATIFIED,
+    SAMPLER_IMPORTANCE,
+    NUM_SAMPLERS
+};
+const char* const sampler_names[NUM_SAMPLERS] = {"uniform", "stratified", "importance"};
+
+/**
+ * How samples in [lower, upper] are drawn and weighted.
+ * Each sample's value g is an unbiased estimate of the whole integral.
+ */
+struct sampler {
+    enum sampler_kind kind;
+    int strata;          // 1 unless stratified
+    double lower, width;
+    double theta_lower, theta_width;  // importance: atan range of the Cauchy
+};
+
 // Choose whether to include debug features and logging.
 // #define DEBUG
 
@@ -24,19 +88,26 @@ const int FROM_WORKER = 2;
 //------------------------------
 // Math formulas
 //------------------------------
+#pragma omp declare simd
 double f(const double x);
-double h_x(const double, const double, const int);
+double h_x(const double, const double, const uint64_t, const long long);
 
 double map(double x, double in_min, double in_max, double out_min, double out_max); 
 
 //------------------------------
 // MPI helper functions
 //------------------------------
-void init_rand_seed(void); 
 double estimate_g(const double, const double, const long long);
-void collect_results(const double* const);
+void collect_results(const double* const, const double, const long long);
 DBG(void test_rng(const double, const double);)
 
+void split_samples(const long long, const int, const int, long long* const, long long* const);
+struct sampler make_sampler(const enum sampler_kind, const double, const double);
+void sample_values(const struct sampler* const, const uint64_t, const double* const, double* const, const int);
+void sample_round(const struct sampler* const, const uint64_t, const long long, double* const);
+void summarize(const struct sampler* const, const kahan_sum* const, double* const, double* const);
+void estimate_adaptive(const double, const double, const long long, const double, const enum sampler_kind);
+
 
 //------------------------------
 // Performance profiling
@@ -50,19 +121,63 @@ struct timespec start_time, stop_time;
 int main(int argc, char* argv[]) {
     MPI_Init(&argc, &argv);
 
+    int my_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    if (argc < 3 + 1 || argc > 5 + 1) {
+        if (my_rank == MASTER) {
+            printf("Usage: %s <lower bound> <upper bound> <number of samples> [tolerance [sampler]]\n", argv[0]);
+            printf("  With a tolerance, <number of samples> is the budget and the run stops\n");
+            printf("  once the confidence interval half-width is below it (0: never stop early).\n");
+            printf("  sampler: uniform | stratified | importance (default uniform)\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
     // Define constants
     const double lower_bound = atof(argv[1]);
     const double upper_bound = atof(argv[2]);
+    // atof so "1e10" works; exact for any count below 2^53.
     const long long N = atof(argv[3]);
 
-    // Initialize different seeds to get better variance among workers
-    init_rand_seed();
+    if (N <= 0) {
+        if (my_rank == MASTER) {
+            printf("Number of samples must be positive.\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (argc > 4) {
+        const double tolerance = atof(argv[4]);
+        enum sampler_kind kind = SAMPLER_UNIFORM;
+        if (argc > 5) {
+            for (kind = 0; kind < NUM_SAMPLERS; kind++) {
+                if (strcmp(argv[5], sampler_names[kind]) == 0) {
+                    break;
+                }
+            }
+            if (kind == NUM_SAMPLERS) {
+                if (my_rank == MASTER) {
+                    printf("Unknown sampler '%s'.\n", argv[5]);
+                }
+                MPI_Finalize();
+                return 1;
+            }
+        }
+
+        estimate_adaptive(lower_bound, upper_bound, N, tolerance, kind);
+
+        MPI_Finalize();
+        return 0;
+    }
 
     // Run N estimations and send them to the master.
     double result = estimate_g(lower_bound, upper_bound, N);
 
     // The master will tally up the estimations, yielding the final result.
-    collect_results(&result);
+    collect_results(&result, upper_bound - lower_bound, N);
 
     MPI_Finalize();
     return 0;
@@ -74,25 +189,61 @@ int main(int argc, char* argv[]) {
 //------------------------------
 /**
  * The formula to be integrated.
+ * 8 * sqrt(2 * pi) / exp((2x)^2), with the constant folded and the
+ * pow/divide turned into one vectorizable exp(-4x^2).
  */
 double f(double x) {
-    return 8 * sqrt(2 * M_PI) / exp(pow(2 * x, 2));
+    return F_SCALE * simd_exp(-4 * x * x);
 }
 
+// Lets OpenMP combine per-thread compensated sums.
+#pragma omp declare reduction(kahan : kahan_sum : kahan_merge(&omp_out, &omp_in)) \
+    initializer(omp_priv = (kahan_sum){0, 0})
+
 /**
  * The monte-carlo integral.
  * Used by workers to obtain their results.
+ * first: global index of this worker's first sample.
  * n: number of iterations.
+ * Returns the sum of f over the samples; scaling to the integral
+ * happens once all ranks' sums are in (see collect_results()).
+ *
+ * The samples are split over this rank's OpenMP threads, each drawing its
+ * own slice of the sample sequence, and f is evaluated a SIMD batch at a time.
+ * Each batch's partial sum is folded into a compensated sum so that long
+ * runs don't lose precision.
  */
-double h_x(const double lower_bound, const double upper_bound, const int n) {
-    double sum = 0;
-
-    for (int i = 0; i < n; i++) {
-        double random_sample = map(rand(), 0, RAND_MAX, lower_bound, upper_bound);
-        sum += f(random_sample);
+double h_x(const double lower_bound, const double upper_bound, const uint64_t first, const long long n) {
+    const double width = upper_bound - lower_bound;
+    kahan_sum sum = {0, 0};
+
+    #pragma omp parallel reduction(kahan:sum)
+    {
+        const int num_threads = omp_get_num_threads();
+        const int thread = omp_get_thread_num();
+        const long long begin = n / num_threads * thread + (thread < n % num_threads ? thread : n % num_threads);
+        const long long end = begin + n / num_threads + (thread < n % num_threads);
+
+        philox_stream rng = philox_stream_at(RNG_SEED, first + begin);
+        double samples[PHILOX_BATCH];
+
+        // Draw uniforms a batch at a time; the bulk generator vectorizes.
+        for (long long i = begin; i < end; i += PHILOX_BATCH) {
+            const int batch = (end - i < PHILOX_BATCH) ? end - i : PHILOX_BATCH;
+            philox_fill_uniform(&rng, samples, batch);
+
+            // Same as f(map(sample, 0, 1, lower_bound, upper_bound)).
+            double batch_sum = 0;
+            #pragma omp simd reduction(+:batch_sum)
+            for (int j = 0; j < batch; j++) {
+                batch_sum += f(lower_bound + width * samples[j]);
+            }
+
+            kahan_add(&sum, batch_sum);
+        }
     }
 
-    return (upper_bound - lower_bound) / n * sum; // TODO should this only return sum, and the rest be calculated later in collect_results()?
+    return kahan_total(sum);
 }
 
 /**
@@ -105,18 +256,6 @@ double map(double x, double in_min, double in_max, double out_min, double out_ma
 //------------------------------
 // MPI helper functions
 //------------------------------
-/**
-* Initialize a random seed for this worker.
-* Use this worker's rank to seed the RNG.
-*/
-void init_rand_seed(void) {
-    int my_rank;
-    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
-    srand(my_rank);
-
-    DBG(printf("Seed initialized for rank %d.\n", my_rank));
-}
-
 DBG(
 /**
 * Print a few random numbers.
@@ -124,12 +263,12 @@ DBG(
 void test_rng(const double lower_bound, const double upper_bound) {
     for(int i = 0; i < 100; i++) {
         // Get a random number and map it to the valid range.
-        double random_num = map(rand(), 0, RAND_MAX, lower_bound, upper_bound);
+        double random_num = map(philox_uniform_at(RNG_SEED, i), 0, 1, lower_bound, upper_bound);
         printf("%f, ", random_num);
         printf("\n");
 
         // Verify it's within the allowed range.
-        // Honestly this tests `map` moreso than `rand`.
+        // Honestly this tests `map` moreso than the RNG.
         if (random_num < lower_bound || random_num > upper_bound) {
             printf("ERROR: RNG is not mapping to [%f, %f] correctly.\n", lower_bound, upper_bound);
             exit(EXIT_FAILURE);
@@ -142,13 +281,20 @@ void test_rng(const double lower_bound, const double upper_bound) {
  * Workers estimate their portion.
  */
 double estimate_g(const double lower_bound, const double upper_bound, const long long N) {
-    // Divide iterations evenly among all processes
-    int num_nodes;
+    // Divide iterations evenly among all processes.
+    // The first N % num_nodes ranks take one extra so no samples are dropped.
+    int num_nodes, my_rank;
     MPI_Comm_size(MPI_COMM_WORLD, &num_nodes);
-    const int num_iterations = N / num_nodes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    const long long extra = N % num_nodes;
+    const long long num_iterations = N / num_nodes + (my_rank < extra);
+
+    // Each rank draws its own slice of the global sample sequence.
+    const uint64_t first = (uint64_t)my_rank * (N / num_nodes) + (my_rank < extra ? my_rank : extra);
+    DBG(printf("Rank %d starts at sample %llu.\n", my_rank, (unsigned long long)first));
 
     start_time = now();
-    return h_x(lower_bound, upper_bound, num_iterations);
+    return h_x(lower_bound, upper_bound, first, num_iterations);
 }
 
 
@@ -156,8 +302,11 @@ double estimate_g(const double lower_bound, const double upper_bound, const long
 * The workers send their results to the master.
 * Master collects the results of each worker and sums 
 * them together.
+* result: this rank's sum of f over its samples.
+* width: upper_bound - lower_bound.
+* N: total number of samples over all ranks.
 */
-void collect_results(const double* const result) {
+void collect_results(const double* const result, const double width, const long long N) {
     int my_rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
 
@@ -176,18 +325,17 @@ void collect_results(const double* const result) {
         // }
 
         // Use a reducer to collect all the incoming MPI data.
+        // (This already includes the master's own result.)
         MPI_Reduce(result, &sum, 1, MPI_DOUBLE, MPI_SUM, MASTER, MPI_COMM_WORLD);
 
-        // Add master's own result, too.
-        sum += *result;
-
-
-        // To take the mean, divide by num_nodes
-        sum /= num_nodes;
+        // Ranks may have done different numbers of samples, so scale the
+        // grand total rather than averaging the per-rank estimates.
+        sum *= width / N;
 
         stop_time = now();
 
         // print stats
+        printf("Ranks: %d, threads per rank: %d, samples: %lld\n", num_nodes, omp_get_max_threads(), N);
         printf("Approximation: %f\n", sum);
 
         const double elapsed_time = tdiff(start_time, stop_time);
@@ -200,6 +348,255 @@ void collect_results(const double* const result) {
     }
 }
 
+//------------------------------
+// Adaptive mode
+//------------------------------
+/**
+ * Split n samples over `parts`, the first n % parts getting one extra.
+ * offset: first sample of part `part`; count: how many it gets.
+ */
+void split_samples(const long long n, const int parts, const int part, long long* const offset, long long* const count) {
+    const long long extra = n % parts;
+    *offset = n / parts * part + (part < extra ? part : extra);
+    *count = n / parts + (part < extra);
+}
+
+struct sampler make_sampler(const enum sampler_kind kind, const double lower_bound, const double upper_bound) {
+    struct sampler s = {
+        .kind = kind,
+        .strata = (kind == SAMPLER_STRATIFIED) ? STRATA : 1,
+        .lower = lower_bound,
+        .width = upper_bound - lower_bound,
+    };
+
+    if (kind == SAMPLER_IMPORTANCE) {
+        s.theta_lower = atan((lower_bound - IMPORTANCE_CENTER) / IMPORTANCE_SCALE);
+        s.theta_width = atan((upper_bound - IMPORTANCE_CENTER) / IMPORTANCE_SCALE) - s.theta_lower;
+    }
+
+    return s;
+}
+
+/**
+ * Turn a batch of uniforms into sample values.
+ * index: global index of u[0] (picks the stratum).
+ */
+void sample_values(const struct sampler* const s, const uint64_t index, const double* const u, double* const g, const int batch) {
+    const double lower = s->lower, width = s->width;
+
+    switch (s->kind) {
+    case SAMPLER_UNIFORM:
+        #pragma omp simd
+        for (int j = 0; j < batch; j++) {
+            g[j] = width * f(lower + width * u[j]);
+        }
+        break;
+
+    case SAMPLER_STRATIFIED: {
+        // Sample i falls in stratum i % strata, so every run of `strata`
+        // consecutive samples covers each stratum once.
+        const int strata = s->strata;
+        const int first_stratum = index % strata;
+        const double stratum_width = width / strata;
+        #pragma omp simd
+        for (int j = 0; j < batch; j++) {
+            const int h = (first_stratum + j) % strata;
+            g[j] = width * f(lower + stratum_width * (h + u[j]));
+        }
+        break;
+    }
+
+    case SAMPLER_IMPORTANCE: {
+        // Inverse-CDF sample of the Cauchy density truncated to [lower, upper]:
+        //   x = c + s * tan(theta), theta uniform in [theta_lower, theta_upper],
+        //   p(x) = 1 / (s * theta_width * (1 + tan(theta)^2)).
+        const double scale = IMPORTANCE_SCALE * s->theta_width;
+        for (int j = 0; j < batch; j++) {
+            const double t = tan(s->theta_lower + s->theta_width * u[j]);
+            g[j] = f(IMPORTANCE_CENTER + IMPORTANCE_SCALE * t) * scale * (1 + t * t);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/**
+ * This rank's moments for global samples [first, first + n).
+ * moments: MOMENTS doubles per stratum (sum, sum of squares, count).
+ *
+ * Threads split the range the same way h_x() does; each keeps
+ * compensated per-stratum sums and they're merged at the end.
+ */
+void sample_round(const struct sampler* const s, const uint64_t first, const long long n, double* const moments) {
+    const int strata = s->strata;
+    kahan_sum totals[MOMENTS * STRATA] = {{0, 0}};
+
+    #pragma omp parallel
+    {
+        long long begin, count;
+        split_samples(n, omp_get_num_threads(), omp_get_thread_num(), &begin, &count);
+        const long long end = begin + count;
+
+        kahan_sum local[MOMENTS * STRATA] = {{0, 0}};
+        philox_stream rng = philox_stream_at(RNG_SEED, first + begin);
+        double u[PHILOX_BATCH], g[PHILOX_BATCH];
+
+        for (long long i = begin; i < end; i += PHILOX_BATCH) {
+            const int batch = (end - i < PHILOX_BATCH) ? end - i : PHILOX_BATCH;
+            philox_fill_uniform(&rng, u, batch);
+            sample_values(s, first + i, u, g, batch);
+
+            // Stratum h's samples sit at a stride of `strata` in the batch.
+            for (int h = 0; h < strata; h++) {
+                const int offset = (h - (int)((first + i) % strata) + strata) % strata;
+                double sum = 0, sum_sq = 0;
+                #pragma omp simd reduction(+:sum, sum_sq)
+                for (int j = offset; j < batch; j += strata) {
+                    sum += g[j];
+                    sum_sq += g[j] * g[j];
+                }
+
+                kahan_add(&local[MOMENTS * h], sum);
+                kahan_add(&local[MOMENTS * h + 1], sum_sq);
+                kahan_add(&local[MOMENTS * h + 2], offset < batch ? (batch - offset + strata - 1) / strata : 0);
+            }
+        }
+
+        #pragma omp critical
+        for (int m = 0; m < MOMENTS * strata; m++) {
+            kahan_merge(&totals[m], &local[m]);
+        }
+    }
+
+    for (int m = 0; m < MOMENTS * strata; m++) {
+        moments[m] = kahan_total(totals[m]);
+    }
+}
+
+/**
+ * Estimate and confidence interval half-width from the moments so far.
+ * Strata have equal width, so the estimate is the mean of the stratum
+ * means and its variance the sum of their variances / strata^2.
+ */
+void summarize(const struct sampler* const s, const kahan_sum* const totals, double* const estimate, double* const half_width) {
+    const int strata = s->strata;
+    double mean = 0, variance = 0;
+
+    for (int h = 0; h < strata; h++) {
+        const double sum = kahan_total(totals[MOMENTS * h]);
+        const double sum_sq = kahan_total(totals[MOMENTS * h + 1]);
+        const double n = kahan_total(totals[MOMENTS * h + 2]);
+
+        const double stratum_mean = sum / n;
+        const double sample_var = fmax(sum_sq - sum * stratum_mean, 0) / (n - 1);
+        mean += stratum_mean / strata;
+        variance += sample_var / n / ((double)strata * strata);
+    }
+
+    *estimate = mean;
+    *half_width = CONFIDENCE_Z * sqrt(variance);
+}
+
+/**
+ * Sample in rounds of ADAPTIVE_ROUND until the confidence interval
+ * half-width drops below `tolerance` or `N` samples have been drawn.
+ *
+ * Rounds cover consecutive global sample indices and are split over ranks
+ * like the fixed-N run, so the result doesn't depend on the rank count.
+ * Each round's moments are summed over ranks with MPI_Iallreduce while the
+ * next round is sampled, so the reduction is off the critical path. Every
+ * rank gets the same totals and makes the same stop decision. The round
+ * already in flight when the tolerance is met is folded in as well.
+ */
+void estimate_adaptive(const double lower_bound, const double upper_bound, const long long N,
+                       const double tolerance, const enum sampler_kind kind) {
+    int num_nodes, my_rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &num_nodes);
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    const struct sampler s = make_sampler(kind, lower_bound, upper_bound);
+    const int num_moments = MOMENTS * s.strata;
+
+    // Need two samples per stratum before there's a variance.
+    if (N < 2 * s.strata) {
+        if (my_rank == MASTER) {
+            printf("ERROR: %s sampling needs at least %d samples.\n", sampler_names[kind], 2 * s.strata);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Double-buffered: one round is reduced while the next is sampled.
+    double local[2][MOMENTS * STRATA], global[2][MOMENTS * STRATA];
+    kahan_sum totals[MOMENTS * STRATA] = {{0, 0}};
+    MPI_Request request = MPI_REQUEST_NULL;
+    long long next = 0, pending = 0, done = 0;
+    int buf = 0, rounds = 0, converged = 0;
+    double estimate = 0, half_width = INFINITY;
+
+    start_time = now();
+
+    while (!converged && (next < N || pending)) {
+        // The first round must reach every stratum twice.
+        const long long round_size = (ADAPTIVE_ROUND > 2 * s.strata) ? ADAPTIVE_ROUND : 2 * s.strata;
+        const long long round = (N - next < round_size) ? N - next : round_size;
+
+        if (round > 0) {
+            long long offset, count;
+            split_samples(round, num_nodes, my_rank, &offset, &count);
+            sample_round(&s, next + offset, count, local[buf]);
+            next += round;
+        }
+
+        if (pending) {
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+            for (int m = 0; m < num_moments; m++) {
+                kahan_add(&totals[m], global[!buf][m]);
+            }
+            done += pending;
+            rounds++;
+
+            summarize(&s, totals, &estimate, &half_width);
+            converged = (tolerance > 0 && half_width <= tolerance);
+        }
+
+        if (round > 0) {
+            MPI_Iallreduce(local[buf], global[buf], num_moments, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &request);
+            pending = round;
+            buf = !buf;
+        }
+        else {
+            pending = 0;
+        }
+    }
+
+    // Already paid for, so use it.
+    if (pending) {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        for (int m = 0; m < num_moments; m++) {
+            kahan_add(&totals[m], global[!buf][m]);
+        }
+        done += pending;
+        rounds++;
+        summarize(&s, totals, &estimate, &half_width);
+    }
+
+    stop_time = now();
+
+    if (my_rank == MASTER) {
+        printf("Ranks: %d, threads per rank: %d, samples: %lld of %lld in %d rounds (%s sampling)\n",
+               num_nodes, omp_get_max_threads(), done, N, rounds, sampler_names[kind]);
+        printf("Approximation: %f\n", estimate);
+        printf("Confidence interval (z = %.2f): +/- %e\n", CONFIDENCE_Z, half_width);
+        if (tolerance > 0) {
+            printf("Tolerance %e %s\n", tolerance, converged ? "met" : "NOT met within the sample budget");
+        }
+        printf("Elapsed time: %f\n", tdiff(start_time, stop_time));
+    }
+}
+
 //------------------------------
 // Performance profiling
 //------------------------------
@@ -7,9 +7,11 @@
 #SBATCH --nodes=2
 #SBATCH --ntasks=4
 #SBATCH --ntasks-per-node=2
-#SBATCH --cpus-per-task=1
+#SBATCH --cpus-per-task=4
 #SBATCH --mem-per-cpu=1000mb
 #SBATCH -t 00:01:00
 #SBATCH -o myout
 #SBATCH -e myerr
+export OMP_NUM_THREADS=$SLURM_CPUS_PER_TASK
+#(N | input.pgm | @list.txt, [iterations[:passes per halo exchange]], [halo exchange: sendrecv | persistent], [decomposition: rows | cols | 2d | auto | stream], [filter: weighted_avg | blur3 | blur5 | box5 | sobel | laplacian], [output.pgm])
 srun --mpi=pmix_v3 ./weighted_avg_filter 15
@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <omp.h>
 #include "mpi.h"
 
 //////////////////////////////
@@ -17,25 +21,125 @@
 #define RELEASE(x) x
 #endif
 
+// Only print matrices with at most this many rows and cols.
+#define PRINT_MAX 32
+
+// Bits per pixel: 8 (default) or 16. The matrix, every MPI transfer and the
+// slabs hold pixels; sums are only widened to int inside the filter.
+#ifndef PIXEL_BITS
+#define PIXEL_BITS 8
+#endif
+
+#if PIXEL_BITS == 8
+typedef uint8_t pixel;
+#define PIXEL_MAX UINT8_MAX
+#define MPI_PIXEL MPI_UNSIGNED_CHAR
+#define PIXEL_FORMAT "%3d"
+#elif PIXEL_BITS == 16
+typedef uint16_t pixel;
+#define PIXEL_MAX UINT16_MAX
+#define MPI_PIXEL MPI_UNSIGNED_SHORT
+#define PIXEL_FORMAT "%5d"
+#else
+#error "PIXEL_BITS must be 8 or 16"
+#endif
+
+#define STENCIL_PIXEL pixel
+#define STENCIL_PIXEL_MAX PIXEL_MAX
+#include "stencil.h"
+
 const int MASTER = 0;
 const int FROM_MASTER = 1;
 const int FROM_WORKER = 0;
 
+// Halo exchange message types, named for the direction the data travels.
+const int HALO_UP = 2;    // a rank's first row, going to the rank above
+const int HALO_DOWN = 3;  // a rank's last row, going to the rank below
+const int HALO_LEFT = 4;  // a rank's first column, going to the rank on the left
+const int HALO_RIGHT = 5; // a rank's last column, going to the rank on the right
+
+// measure_rates()'s timing messages between the master and rank 1.
+const int PLAN_PING = 6;
+
+// How ghost cells are refreshed between passes.
+enum exchange {
+    EXCHANGE_SENDRECV,   // MPI_Sendrecv calls per pass
+    EXCHANGE_PERSISTENT, // MPI_Send_init/MPI_Recv_init once, MPI_Startall per pass
+    NUM_EXCHANGES
+};
+const char* const exchange_names[NUM_EXCHANGES] = {"sendrecv", "persistent"};
+
+// How the matrix is cut into blocks.
+enum decomposition {
+    DECOMP_ROWS,   // R x 1 grid: bands of whole rows
+    DECOMP_COLS,   // 1 x R grid: bands of whole columns
+    DECOMP_2D,     // as square a grid as MPI_Dims_create can make
+    DECOMP_AUTO,   // whichever grid, rank count and halo depth plan_grid() predicts is fastest
+    DECOMP_STREAM, // bands of whole rows, streamed file to file (see stream_filter())
+    NUM_DECOMPS
+};
+const char* const decomp_names[NUM_DECOMPS] = {"rows", "cols", "2d", "auto", "stream"};
+
+// Rows per chunk of the wavefront in temporally blocked passes (see
+// temporal_block()). A chunk of every pass in the block should fit in L2.
+#ifndef TEMPORAL_TILE
+#define TEMPORAL_TILE 16
+#endif
+
+// Rows per band in stream mode. Each rank holds 2 bands of input (plus
+// their halo rows) and 2 bands of output, whatever the image's height.
+#ifndef STREAM_BAND
+#define STREAM_BAND 256
+#endif
+
+// The auto decomposition times the filter on a PLAN_SAMPLE x PLAN_SAMPLE
+// block and the network with PLAN_MESSAGE-byte messages (see
+// measure_rates()), then tries halos up to PLAN_MAX_DEPTH passes deep.
+#ifndef PLAN_SAMPLE
+#define PLAN_SAMPLE 256
+#endif
+#ifndef PLAN_MESSAGE
+#define PLAN_MESSAGE (1 << 20)
+#endif
+#ifndef PLAN_MAX_DEPTH
+#define PLAN_MAX_DEPTH 8
+#endif
+
+// Images in flight in batch mode: one being read by the master, one being
+// scattered, one being filtered and one being gathered (see batch_filter()).
+#define BATCH_DEPTH 4
+
 //////////////////////////////
 // Helper functions
 //////////////////////////////
 int rand_range(const int min, const int max);
 
-void print_matrix(const int M, const int N, const int (* matrix)[M]);
+void print_matrix(const int M, const int N, const pixel (* matrix)[N]);
+
+void split_rows(const int M, const int parts, const int part, int* const offset, int* const rows);
 
 //////////////////////////////
 // Structures
 //////////////////////////////
-struct matrix {
+/**
+ * One rank's resident block of the matrix.
+ * buf and next are (rows + 2*halo) x (cols + 2*halo): the block this rank
+ * owns, surrounded by a ring of ghost cells copied from the neighbouring
+ * blocks. The ring is as deep as the filter's radius.
+ * Each pass reads buf and writes next, then the two are swapped.
+ */
+struct slab {
     void* buf;
-    int size;
-    int M;
-    int N;
+    void* next;
+    const struct stencil_kernel* kernel;
+    int halo;                   // depth of the ghost ring
+    int rows, cols;             // size of the block this rank owns
+    int first_row, first_col;   // global index of its top-left element
+    int M;                      // rows in the whole matrix
+    int N;                      // cols
+    MPI_Comm grid;              // Cartesian process grid
+    int up, down, left, right;  // neighbouring ranks (MPI_PROC_NULL at the edges)
+    MPI_Datatype column;        // `halo` columns of owned rows, strided through buf
 };
 
 struct sendcounts_displacements {
@@ -43,42 +147,309 @@ struct sendcounts_displacements {
     int* displacements;
 };
 
+/**
+ * A binary PGM (P5) image file: a text header, then M rows of N pixels,
+ * 1 byte each if maxval < 256, else 2 bytes, most significant first.
+ */
+struct image {
+    int M, N;           // rows, cols
+    int maxval;         // brightest pixel value
+    MPI_Offset offset;  // where the pixels start
+};
+
+/**
+ * How fast this machine filters and communicates (see measure_rates()).
+ */
+struct rates {
+    double cell;        // seconds to filter one cell on one thread
+    double latency;     // seconds per message
+    double bandwidth;   // bytes per second, contiguous (row halos)
+    double strided;     // bytes per second, a few bytes every row (column halos)
+};
+
+/**
+ * The grid the auto decomposition picked for an image, and how long it
+ * expects each part of the run to take (see plan_grid()).
+ */
+struct plan {
+    int dims[2];        // grid rows x cols: the first dims[0] * dims[1] ranks take part
+    int per_exchange;   // passes per halo exchange
+    double compute;     // predicted seconds filtering
+    double exchange;    // predicted seconds exchanging halos
+    double distribute;  // predicted seconds scattering and gathering
+};
+
+/**
+ * One image of a batch on its way through the pipeline (see batch_filter()).
+ * Only the master has the paths, the whole image and the packed blocks.
+ */
+struct batch_image {
+    const char* input;
+    const char* output;
+    struct image image;                 // M, N and maxval
+    pixel* pixels;                      // M x N: the input, then the result
+    pixel* packed;                      // the blocks, packed for the scatter or from the gather
+    struct sendcounts_displacements s_d;
+    struct slab slab;
+    MPI_Datatype type;                  // this rank's ghosted block to scatter, then its owned block to gather
+    MPI_Request request;                // the scatter, then the gather
+};
+
 //////////////////////////////
 // Function declarations
 //////////////////////////////
 void* initialize_data(const int N);
 
-struct matrix distribute_data(const int N, int (*matrix)[N]);
-
-struct matrix mask_operation(const int N, const int worker_submatrix_size, int (*worker_submatrix)[N]);
-
-void collect_results(const int M, const int N, struct matrix worker_submatrix);
+MPI_Comm create_grid(const enum decomposition decomp, const struct plan* const plan);
+struct rates measure_rates(const struct stencil_kernel* const kernel);
+double ping_pong(char* const msg, const int count, const MPI_Datatype type, const int other, const int reps);
+struct plan plan_grid(const int M, const int N, const int radius, const int iterations, const int per_exchange,
+                      const int distributed, const int num_ranks, const struct rates* const rates);
+void block_of(const MPI_Comm grid, const int rank, const int M, const int N, const int halo,
+              int* const first_row, int* const rows, int* const first_col, int* const cols);
+
+struct slab distribute_data(const int M, const int N, pixel (*matrix)[N], const MPI_Comm grid,
+                            const struct stencil_kernel* const kernel, const int halo,
+                            const char* const input, const struct image* const image);
+struct slab make_slab(const int M, const int N, const MPI_Comm grid,
+                      const struct stencil_kernel* const kernel, const int halo);
+pixel* pack_blocks(const MPI_Comm grid, const int M, const int N, const int halo, const pixel (*matrix)[N],
+                   const struct sendcounts_displacements* const s_d);
+MPI_Datatype ghosted_block(const struct slab* const slab, pixel** const recvbuf);
+void mirror_slab(const struct slab* const slab);
+
+void filter_passes(struct slab* const slab, const int iterations, const int per_exchange, const enum exchange exchange);
+void mask_operation(struct slab* const slab, MPI_Request* const halo_requests);
+void filter_block(const struct slab* const slab, const int x0, const int x1, const int y0, const int y1);
+void temporal_block(struct slab* const slab, const int steps);
+
+void exchange_halos(const struct slab* const slab);
+void init_persistent_halos(const struct slab* const slab, MPI_Request requests[2][8]);
+
+void collect_results(const int M, const int N, const struct slab* const slab, pixel (*matrix)[N]);
+void unpack_blocks(const MPI_Comm grid, const int M, const int N, const pixel* const recvbuf, const int* const displs,
+                   pixel (*matrix)[N]);
+
+// Image I/O
+struct image read_image_header(const char* const path);
+struct image parse_image_header(FILE* const f, const char* const path);
+int pgm_number(FILE* const f, int* const value);
+void set_block_view(const MPI_File file, const MPI_Offset offset, const int M, const int N,
+                    const int first_row, const int rows, const int first_col, const int cols);
+void swap_pixel_bytes(pixel* const p, const size_t n);
+void read_block(const struct slab* const slab, const char* const path, const struct image* const image);
+void write_image(const struct slab* const slab, const char* const path, const int maxval);
+MPI_Offset write_image_header(const MPI_File file, const int M, const int N, const int maxval);
+pixel* read_pgm(const char* const path, struct image* const image);
+void write_pgm(const char* const path, const struct image* const image, pixel* const pixels);
+
+// Batches
+void batch_filter(const char* const list, const MPI_Comm grid, const struct stencil_kernel* const kernel,
+                  const int iterations, const int per_exchange, const enum exchange exchange);
+char** read_batch_list(const char* const path, int* const count);
+void batch_load(struct batch_image* const b, const char* const input, const char* const output);
+void batch_scatter(struct batch_image* const b, const MPI_Comm grid, const struct stencil_kernel* const kernel,
+                   const int halo);
+void batch_gather(struct batch_image* const b, const int iterations, const int per_exchange,
+                  const enum exchange exchange);
+void batch_finish(struct batch_image* const b);
+
+// Streaming
+void stream_filter(const char* const input, const struct image* const image, const char* const output,
+                   const struct stencil_kernel* const kernel, const int iterations);
+void stream_pass(const MPI_File in_file, const MPI_Offset in_offset, const MPI_File out_file, const MPI_Offset out_offset,
+                 const int M, const int N, const struct stencil_kernel* const kernel, long long* const checksum);
+void stream_band(const pixel* const in, const int in_first_row, pixel* const out, const int x0, const int n,
+                 const int M, const int N, const struct stencil_kernel* const kernel);
+int same_file(const char* const a, const char* const b);
 
 // Performance Profiling
 double tdiff(const struct timespec start, const struct timespec stop);
 struct timespec now(void);
 struct timespec start_time, stop_time;
 
- 
+
 //////////////////////////////
 int main(int argc, char* argv[]) {
-    MPI_Init(&argc, &argv);
+    // Threads filter the rows; only the main thread talks to MPI.
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+    int my_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (my_rank == MASTER) {
+            printf("ERROR: MPI doesn't support MPI_THREAD_FUNNELED.\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (argc < 1 + 1 || argc > 6 + 1) {
+        if (my_rank == MASTER) {
+            printf("Usage: %s <N | input.pgm | @list.txt> [iterations] [sendrecv | persistent] [rows | cols | 2d | auto | stream] [filter] [output.pgm]\n", argv[0]);
+            printf("  iterations: <passes>[:<passes per halo exchange>] (default 1 pass, exchange every pass)\n");
+            printf("  filters:");
+            for (int k = 0; k < STENCIL_NUM_KERNELS; k++) {
+                printf(" %s", stencil_kernels[k].name);
+            }
+            printf(" (default weighted_avg)\n");
+            printf("  A number generates an N x N matrix on the master; anything else is a binary PGM\n"
+                   "  image that each rank reads its block of. An image needs an output file.\n"
+                   "  auto times the filter and the network, then picks the grid, how many ranks take part and\n"
+                   "  (unless iterations gives it) the passes per halo exchange.\n"
+                   "  stream filters an image file to file in bands of %d rows, for images too big for memory.\n"
+                   "  @list.txt filters a batch of images, one \"input.pgm output.pgm\" pair per line, scattering\n"
+                   "  and gathering the images before and after each one while it's filtered.\n",
+                   STREAM_BAND);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Either a generated N x N matrix, or the image's size from its header.
+    char* n_end;
+    const long n_arg = strtol(argv[1], &n_end, 10);
+    const char* const batch = (argv[1][0] == '@') ? argv[1] + 1 : NULL;
+    const char* const input = (*n_end == '\0' || batch != NULL) ? NULL : argv[1];
+    const char* const output = (argc > 6) ? argv[6] : NULL;
+
+    struct image image = { .M = (int)n_arg, .N = (int)n_arg, .maxval = PIXEL_MAX, .offset = 0 };
+    if (input != NULL) {
+        image = read_image_header(input);
+    }
+    const int M = image.M;
+    const int N = image.N;
+    // "12:4" is 12 passes with 4-deep halos, exchanged every 4 passes.
+    const int iterations = (argc > 2) ? atoi(argv[2]) : 1;
+    const char* const per_exchange_arg = (argc > 2) ? strchr(argv[2], ':') : NULL;
+    int per_exchange = (per_exchange_arg != NULL) ? atoi(per_exchange_arg + 1) : 1;
+    if (per_exchange > iterations) {
+        per_exchange = iterations;
+    }
+
+    enum exchange exchange = EXCHANGE_SENDRECV;
+    if (argc > 3) {
+        for (exchange = 0; exchange < NUM_EXCHANGES; exchange++) {
+            if (strcmp(argv[3], exchange_names[exchange]) == 0) {
+                break;
+            }
+        }
+    }
+
+    enum decomposition decomp = DECOMP_ROWS;
+    if (argc > 4) {
+        for (decomp = 0; decomp < NUM_DECOMPS; decomp++) {
+            if (strcmp(argv[4], decomp_names[decomp]) == 0) {
+                break;
+            }
+        }
+    }
+
+    const struct stencil_kernel* const kernel = stencil_find((argc > 5) ? argv[5] : "weighted_avg");
+
+    if ((batch == NULL && (M < 1 || N < 1)) || iterations < 1 || per_exchange < 1 || exchange == NUM_EXCHANGES || decomp == NUM_DECOMPS || kernel == NULL ||
+        (input != NULL && output == NULL) || (decomp == DECOMP_STREAM && input == NULL) ||
+        (decomp == DECOMP_AUTO && batch != NULL)) {
+        if (my_rank == MASTER) {
+            printf("ERROR: Need N >= 1, iterations >= 1 (and passes per exchange >= 1), a known halo exchange, decomposition and filter, "
+                   "and an output file for an input image. Streaming needs an input image (not a batch), and auto a single image.\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Streaming never holds more than a few bands, so it has its own loop.
+    if (decomp == DECOMP_STREAM) {
+        stream_filter(input, &image, output, kernel, iterations);
+
+        if (my_rank == MASTER) {
+            int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+            printf("Filter: %s, passes: %d, decomposition: %s (%d ranks, %d threads each)\n",
+                   kernel->name, iterations, decomp_names[decomp], num_ranks, omp_get_max_threads());
+        }
+
+        MPI_Finalize();
+        return 0;
+    }
+
+    // A batch has its own pipeline, image by image.
+    if (batch != NULL) {
+        MPI_Comm grid = create_grid(decomp, NULL);
+        batch_filter(batch, grid, kernel, iterations, per_exchange, exchange);
+
+        if (my_rank == MASTER) {
+            int dims[2], periods[2], coords[2];
+            MPI_Cart_get(grid, 2, dims, periods, coords);
+            printf("Filter: %s, passes: %d (%d per halo exchange), halo exchange: %s, decomposition: %s "
+                   "(%d x %d ranks, %d threads each)\n",
+                   kernel->name, iterations, per_exchange, exchange_names[exchange], decomp_names[decomp],
+                   dims[0], dims[1], omp_get_max_threads());
+        }
+
+        MPI_Comm_free(&grid);
+        MPI_Finalize();
+        return 0;
+    }
+
+    // Auto picks the grid, how many ranks take part and (unless it was
+    // given) the halo depth for this image, from measured rates.
+    struct plan plan = { .dims = {0, 0}, .per_exchange = per_exchange };
+    if (decomp == DECOMP_AUTO) {
+        int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+        const struct rates rates = measure_rates(kernel);
+        plan = plan_grid(M, N, kernel->radius, iterations, (per_exchange_arg != NULL) ? per_exchange : 0,
+                         input == NULL, num_ranks, &rates);
+        per_exchange = plan.per_exchange;
+
+        if (my_rank == MASTER) {
+            printf("Plan: %d x %d grid (%d of %d ranks), %d passes per halo exchange\n",
+                   plan.dims[0], plan.dims[1], plan.dims[0] * plan.dims[1], num_ranks, plan.per_exchange);
+            printf("  predicted %f s filtering, %f s exchanging halos, %f s scattering and gathering\n",
+                   plan.compute, plan.exchange, plan.distribute);
+            printf("  measured %.3f ns per cell per thread, %.3f us per message, %.1f MB/s (%.1f MB/s strided)\n",
+                   rates.cell * 1e9, rates.latency * 1e6, rates.bandwidth / 1e6, rates.strided / 1e6);
+        }
+    }
+
+    // Initialize the matrix (only the master holds it, and only if it's
+    // generated here).
+    pixel (* const matrix)[N] = (input == NULL) ? initialize_data(N) : NULL;
+
+    // Each rank gets its block plus a ring of ghost cells, and keeps them
+    // for every pass. The ring holds enough for per_exchange passes.
+    const MPI_Comm grid = create_grid(decomp, &plan);
+    if (grid == MPI_COMM_NULL) {
+        // Left out of the plan.
+        MPI_Finalize();
+        return 0;
+    }
+    struct slab slab = distribute_data(M, N, matrix, grid, kernel, per_exchange * kernel->radius, input, &image);
 
-    const int N = atof(argv[1]);
+    filter_passes(&slab, iterations, per_exchange, exchange);
 
-    // Initialize the matrix
-    int (* const matrix)[N] = initialize_data(N);
+    if (output != NULL) {
+        write_image(&slab, output, image.maxval);
+    }
+    else {
+        collect_results(M, N, &slab, matrix);
+    }
 
-    // int (*worker_submatrix)[] = distribute_data(N, matrix);
-    struct matrix r_s = distribute_data(N, matrix);
-    int (* const worker_submatrix)[] = r_s.buf;
-    const int worker_submatrix_size = r_s.size;
+    if (my_rank == MASTER) {
+        int dims[2], periods[2], coords[2];
+        MPI_Cart_get(grid, 2, dims, periods, coords);
+        printf("Filter: %s, passes: %d (%d per halo exchange), halo exchange: %s, decomposition: %s "
+               "(%d x %d ranks, %d threads each)\n",
+               kernel->name, iterations, per_exchange, exchange_names[exchange], decomp_names[decomp],
+               dims[0], dims[1], omp_get_max_threads());
+    }
 
-    struct matrix results = mask_operation(N, worker_submatrix_size, worker_submatrix);
-    collect_results(N, N, results);
+    MPI_Type_free(&slab.column);
+    MPI_Comm_free(&slab.grid);
 
     MPI_Finalize();
-    free(worker_submatrix);
+    free(slab.buf);
+    free(slab.next);
     free(matrix);
 
     return 0;
@@ -92,7 +463,9 @@ int main(int argc, char* argv[]) {
  */
 int rand_range(const int min, const int max) {
     const int diff = max - min;
-    return (int) (((double)(diff + 1) / RAND_MAX) * rand() + min);
+    const int r = (int) (((double)(diff + 1) / RAND_MAX) * rand() + min);
+    // rand() == RAND_MAX lands one past max, which wouldn't fit in a pixel.
+    return (r > max) ? max : r;
 }
 
 /**
@@ -100,17 +473,31 @@ int rand_range(const int min, const int max) {
  * M: rows
  * N: cols
  */
-void print_matrix(const int M, const int N, const int (* const matrix)[N]) {
+void print_matrix(const int M, const int N, const pixel (* const matrix)[N]) {
     printf("=============== Matrix ===============\n");
     for(int r = 0; r < M; r++) {
         for(int c = 0; c < N; c++) {
-            printf("%3d ", matrix[r][c]);
+            printf(PIXEL_FORMAT " ", matrix[r][c]);
         }
         printf("\n");
     }
     printf("======================================\n");
 }
 
+/**
+ * Divide M rows as evenly as possible over `parts` ranks.
+ * The first M % parts ranks get one extra row.
+ * offset: first row of rank `part`; rows: how many it gets.
+ * (Used for columns, too.)
+ */
+void split_rows(const int M, const int parts, const int part, int* const offset, int* const rows) {
+    const int averow = M / parts;
+    const int extra = M % parts;
+
+    *rows = (part < extra) ? averow + 1 : averow;
+    *offset = part * averow + (part < extra ? part : extra);
+}
+
 /**
 * Initialize and return data for
 * an NxN matrix A.
@@ -127,11 +514,11 @@ void* initialize_data(const int N) {
     // Using epic c99 array pointer syntax :D
     // see https://stackoverflow.com/questions/32050256/function-to-dynamically-allocate-matrix
     //
-    // NOTE: The type declaration needs cols in the square brackets. So it's `int (*)[num_cols]`.
+    // NOTE: The type declaration needs cols in the square brackets. So it's `pixel (*)[num_cols]`.
     // sizeof doesn't matter because it just makes a block
 
     const int M = N; // For consistency with MxN matrices.
-    int (*matrix)[N] = malloc(sizeof(int[M][N]));
+    pixel (*matrix)[N] = malloc(sizeof(pixel[M][N]));
 
     if (matrix == NULL) {
         printf("ERROR: Couldn't allocate matrix.\n");
@@ -149,96 +536,305 @@ void* initialize_data(const int N) {
                 // matrix[r][c] = r * N + c;
             // )
             // RELEASE(
-                matrix[r][c] = rand_range(0, 255);
+                matrix[r][c] = rand_range(0, PIXEL_MAX);
             // )
         }
     }
 
-    DBG(print_matrix(M, N, (const int (*)[])matrix);)
+    DBG(
+        if (M <= PRINT_MAX && N <= PRINT_MAX) {
+            print_matrix(M, N, (const pixel (*)[])matrix);
+        }
+    )
 
     return matrix;
 }
 
+/**
+ * Arrange all ranks in a 2D grid for the given decomposition, or for auto,
+ * the first plan->dims[0] * plan->dims[1] of them (the rest get
+ * MPI_COMM_NULL).
+ * Ranks aren't reordered, so MASTER is still rank 0 of the grid.
+ */
+MPI_Comm create_grid(const enum decomposition decomp, const struct plan* const plan) {
+    int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    int dims[2] = {0, 0};
+    if (decomp == DECOMP_AUTO) {
+        dims[0] = plan->dims[0];
+        dims[1] = plan->dims[1];
+    }
+    else if (decomp == DECOMP_ROWS) {
+        dims[0] = num_ranks;
+        dims[1] = 1;
+    }
+    else if (decomp == DECOMP_COLS) {
+        dims[0] = 1;
+        dims[1] = num_ranks;
+    }
+    else {
+        MPI_Dims_create(num_ranks, 2, dims);
+    }
 
-// TODO extract a "divide evenly" function to make this easier to understand
-struct sendcounts_displacements generate_sendcounds_and_displacements(
-    const int num_ranks, 
-    const int M, // num rows
-    const int N, // AKA num elements per row, or num cols
-    const int num_rows_per_worker
-) {
-    const int sendcounts_size = num_ranks * sizeof(int);
-    int* const sendcounts = malloc(sendcounts_size);
-    int* const displacements = malloc(num_ranks * sizeof *displacements);
+    const int periods[2] = {0, 0};
+    MPI_Comm grid;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid);
 
-    // Keeps track of odd-numbered matrices, to ensure each row
-    // is placed in a worker's group.
-    int remainder = M % num_ranks;
+    return grid;
+}
 
-    // Total number of data assigned to workers
-    int sum = 0;
+/**
+ * Time the filter and the network, for plan_grid(). Collective.
+ * The master filters a random PLAN_SAMPLE x PLAN_SAMPLE block on one thread,
+ * and ping-pongs with rank 1: one byte for the latency, PLAN_MESSAGE bytes
+ * for the bandwidth, and 8 of every 64 bytes of them for the bandwidth of
+ * a column halo. Everybody gets the master's numbers.
+ */
+struct rates measure_rates(const struct stencil_kernel* const kernel) {
+    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
 
-    for(int rank = 0; rank < num_ranks; rank++) {
-        // The buffer technically must be number of rows * elements per row
-        sendcounts[rank] = num_rows_per_worker * N;
+    double rates[4] = {0.0, 0.0, 0.0, 0.0}; // cell, latency, bandwidth, strided
 
-        if (remainder) {
-            // Give one extra row to this worker.
-            sendcounts[rank] += N;
-            // One less to worry about 
-            remainder--;
+    if (my_rank == MASTER) {
+        const int R = kernel->radius;
+        const int W = PLAN_SAMPLE + 2 * R;
+        pixel* const in = malloc((size_t)W * W * sizeof(pixel));
+        pixel* const out = malloc((size_t)W * W * sizeof(pixel));
+        if (in == NULL || out == NULL) {
+            printf("ERROR: Couldn't allocate the planner's sample block.\n");
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+        for (int i = 0; i < W * W; i++) {
+            in[i] = rand_range(0, PIXEL_MAX);
         }
 
-        displacements[rank] = sum;
+        // Long enough for the clock to be meaningful.
+        const struct timespec start = now();
+        long reps = 0;
+        double elapsed;
+        do {
+            stencil_apply(kernel, PLAN_SAMPLE, PLAN_SAMPLE, &in[R * W + R], W, &out[R * W + R], W);
+            reps++;
+            elapsed = tdiff(start, now());
+        } while (elapsed < 0.01);
+        rates[0] = elapsed / ((double)reps * PLAN_SAMPLE * PLAN_SAMPLE);
+
+        free(in);
+        free(out);
+    }
+
+    if (num_ranks > 1 && my_rank <= 1) {
+        char* const msg = calloc(PLAN_MESSAGE, 1);
+        if (msg == NULL) {
+            printf("ERROR: Couldn't allocate the planner's message.\n");
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
 
-        // int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+        MPI_Datatype column;
+        MPI_Type_vector(PLAN_MESSAGE / 64, 8, 64, MPI_CHAR, &column);
+        MPI_Type_commit(&column);
+
+        const int other = 1 - my_rank;
+        ping_pong(msg, 1, MPI_CHAR, other, 1); // warm up the connection
+        const double latency = ping_pong(msg, 1, MPI_CHAR, other, 50);
+        const double big = ping_pong(msg, PLAN_MESSAGE, MPI_CHAR, other, 5);
+        const double strided = ping_pong(msg, 1, column, other, 5);
+        rates[1] = latency;
+        rates[2] = PLAN_MESSAGE / ((big > 2 * latency) ? big - latency : big);
+        rates[3] = PLAN_MESSAGE / 8 / ((strided > 2 * latency) ? strided - latency : strided);
+
+        MPI_Type_free(&column);
+        free(msg);
+    }
+
+    MPI_Bcast(rates, 4, MPI_DOUBLE, MASTER, MPI_COMM_WORLD);
 
-        // Add one additional row above and one below for neighboring purposes.
-        // Master rank only: Don't add another row above because there isn't one.
-        // You already have the first row, just don't calculate it.
-        if (rank != MASTER) {
-            // For other ranks, add a row above.
-            sendcounts[rank] += N;
+    return (struct rates) { .cell = rates[0], .latency = rates[1], .bandwidth = rates[2], .strided = rates[3] };
+}
 
-            // Sum shouldn't include the extra rows used for neighboring tiles.
-            sum -= N;
+/**
+ * Bounce `count` `type`s of msg between the master and `other` `reps`
+ * times. Returns the average one-way time.
+ */
+double ping_pong(char* const msg, const int count, const MPI_Datatype type, const int other, const int reps) {
+    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
 
-            // Displacements should be shifted down by one row to accomodate for this.
-            displacements[rank] -= N;
+    const struct timespec start = now();
+    for (int r = 0; r < reps; r++) {
+        if (my_rank == MASTER) {
+            MPI_Send(msg, count, type, other, PLAN_PING, MPI_COMM_WORLD);
+            MPI_Recv(msg, count, type, other, PLAN_PING, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
         }
+        else {
+            MPI_Recv(msg, count, type, other, PLAN_PING, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Send(msg, count, type, other, PLAN_PING, MPI_COMM_WORLD);
+        }
+    }
 
-        // Last rank only: Don't add another row below because there isn't one.
-        // You already have the last row, just don't calculate it.
-        if (rank != num_ranks - 1) {
-            // For other ranks, add a row below.
-            sendcounts[rank] += N;
-            // No need to shift displacements since this was added to the end.
+    return tdiff(start, now()) / (2.0 * reps);
+}
+
+/**
+ * Pick the grid (rows x cols of ranks, using up to num_ranks of them) and
+ * the passes per halo exchange that should filter an MxN image fastest.
+ * per_exchange: keep this many passes per exchange, or 0 to pick it too.
+ * distributed: whether the master scatters and gathers the image (rather
+ * than every rank reading and writing its own block).
+ *
+ * The model, per rank, for the largest block (it sets the pace):
+ * - filtering: iterations * cells * rates->cell / threads. With k passes per
+ *   exchange, the passes also recompute on average (k - 1) * radius / 2
+ *   cells into the ghost ring on each side that has a neighbour.
+ * - halo exchanges: every k passes, a latency and the ring's bytes per side
+ *   that has a neighbour, at the strided bandwidth for columns.
+ * - scatter and gather: a latency per rank, and the image's bytes through
+ *   the master.
+ * Blocks thinner than the ghost ring are ruled out, as are grids with more
+ * rows or cols than the image. On a tie the fewest ranks win, so tiny
+ * images don't pay for messages they don't need, then the most grid rows.
+ */
+struct plan plan_grid(const int M, const int N, const int radius, const int iterations, const int per_exchange,
+                      const int distributed, const int num_ranks, const struct rates* const rates) {
+    const int R = radius;
+    const double cell = rates->cell / omp_get_max_threads();
+    const double bytes_per_pixel = sizeof(pixel);
+
+    struct plan best = { .dims = {1, 1}, .per_exchange = (per_exchange > 0) ? per_exchange : 1 };
+    double best_total = -1.0;
+
+    const int k_first = (per_exchange > 0) ? per_exchange : 1;
+    const int k_last = (per_exchange > 0) ? per_exchange : (iterations < PLAN_MAX_DEPTH) ? iterations : PLAN_MAX_DEPTH;
+
+    for (int ranks = 1; ranks <= num_ranks; ranks++) {
+        // Row bands first, so they win ties: their halos are contiguous.
+        for (int rows = ranks; rows >= 1; rows--) {
+            const int cols = ranks / rows;
+            if (rows * cols != ranks || rows > M || cols > N) {
+                continue;
+            }
+
+            const int m = (M + rows - 1) / rows; // largest block
+            const int n = (N + cols - 1) / cols;
+            const int thinnest_m = M / rows;
+            const int thinnest_n = N / cols;
+
+            for (int k = k_first; k <= k_last; k++) {
+                const int H = k * R;
+                if ((rows > 1 && thinnest_m < H) || (cols > 1 && thinnest_n < H)) {
+                    break; // deeper rings are thicker still
+                }
 
-            // Sum shouldn't include the extra rows used for neighboring tiles.
-            sum -= N;
+                const double m_eff = m + ((rows > 1) ? (k - 1) * R : 0);
+                const double n_eff = n + ((cols > 1) ? (k - 1) * R : 0);
+                const double compute = iterations * m_eff * n_eff * cell;
+
+                const int messages = ((rows > 1) ? 2 : 0) + ((cols > 1) ? 2 : 0);
+                const double row_time = (rows > 1) ? bytes_per_pixel * H * 2.0 * (n + 2 * H) / rates->bandwidth : 0.0;
+                const double col_time = (cols > 1) ? bytes_per_pixel * H * 2.0 * m / rates->strided : 0.0;
+                const int exchanges = (iterations - 1) / k;
+                const double exchange = exchanges * (messages * rates->latency + row_time + col_time);
+
+                const double distribute = (distributed && ranks > 1) ?
+                    2.0 * ((ranks - 1) * rates->latency +
+                           bytes_per_pixel * M * N * (ranks - 1) / ranks / rates->bandwidth) : 0.0;
+
+                const double total = compute + exchange + distribute;
+                if (best_total < 0.0 || total < best_total) {
+                    best_total = total;
+                    best = (struct plan) {
+                        .dims = {rows, cols},
+                        .per_exchange = k,
+                        .compute = compute,
+                        .exchange = exchange,
+                        .distribute = distribute,
+                    };
+                }
+            }
         }
+    }
+
+    return best;
+}
+
+/**
+ * The block of the MxN matrix that `rank` of the grid owns.
+ * halo: grow the block by this many rows/cols on each side, stopping at
+ * the edges of the matrix (what the rank needs to filter its block).
+ * Empty blocks (more grid rows/cols than matrix rows/cols) stay empty.
+ */
+void block_of(const MPI_Comm grid, const int rank, const int M, const int N, const int halo,
+              int* const first_row, int* const rows, int* const first_col, int* const cols) {
+    int dims[2], periods[2], coords[2];
+    MPI_Cart_get(grid, 2, dims, periods, coords);
+    MPI_Cart_coords(grid, rank, 2, coords);
+
+    split_rows(M, dims[0], coords[0], first_row, rows);
+    split_rows(N, dims[1], coords[1], first_col, cols);
+
+    if (halo > 0 && *rows > 0 && *cols > 0) {
+        const int last_row = *first_row + *rows; // exclusive
+        const int last_col = *first_col + *cols;
+        const int top = (*first_row < halo) ? *first_row : halo;
+        const int bottom = (M - last_row < halo) ? M - last_row : halo;
+        const int left = (*first_col < halo) ? *first_col : halo;
+        const int right = (N - last_col < halo) ? N - last_col : halo;
+
+        *first_row -= top;
+        *rows += top + bottom;
+        *first_col -= left;
+        *cols += left + right;
+    }
+}
+
+/**
+ * Counts and displacements (in elements) for scattering or gathering blocks.
+ * Blocks are packed one after another in rank order.
+ * halo: include this deep a ring of ghost cells around each block (for the
+ * scatter), or 0 for just the cells each rank owns (for the gather).
+ */
+struct sendcounts_displacements generate_sendcounds_and_displacements(
+    const MPI_Comm grid,
+    const int M, // num rows
+    const int N, // AKA num elements per row, or num cols
+    const int halo
+) {
+    int num_ranks; MPI_Comm_size(grid, &num_ranks);
+
+    int* const sendcounts = malloc(num_ranks * sizeof *sendcounts);
+    int* const displacements = malloc(num_ranks * sizeof *displacements);
+    if (sendcounts == NULL || displacements == NULL) {
+        printf("ERROR: Couldn't allocate sendcounts/displacements.\n");
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
 
-        // Sum shouldn't include the extra rows used for neighboring tiles.
-        // This has already been accounted for!
+    int sum = 0;
+    for(int rank = 0; rank < num_ranks; rank++) {
+        int first_row, rows, first_col, cols;
+        block_of(grid, rank, M, N, halo, &first_row, &rows, &first_col, &cols);
+
+        sendcounts[rank] = rows * cols;
+        displacements[rank] = sum;
         sum += sendcounts[rank];
     }
 
     DBG(
-        printf("sendcounts (# rows): [ ");
-        for(int i = 0; i < num_ranks; i++) {
-            printf("%d ", sendcounts[i] / N);
-        }
-        printf("]\n");
-    )
+        int my_rank; MPI_Comm_rank(grid, &my_rank);
+        if (my_rank == MASTER) {
+            printf("%s sendcounts (# elements): [ ", halo ? "scatter" : "gather");
+            for(int i = 0; i < num_ranks; i++) {
+                printf("%d ", sendcounts[i]);
+            }
+            printf("]\n");
 
-    DBG(
-        printf("displacements: [ ");
-        for(int i = 0; i < num_ranks; i++) {
-            printf("%d ", displacements[i]);
+            printf("%s displacements: [ ", halo ? "scatter" : "gather");
+            for(int i = 0; i < num_ranks; i++) {
+                printf("%d ", displacements[i]);
+            }
+            printf("]\n");
         }
-        printf("]\n");
     )
-    
+
     return (struct sendcounts_displacements) {
         sendcounts,
         displacements
@@ -246,198 +842,1382 @@ struct sendcounts_displacements generate_sendcounds_and_displacements(
 }
 
 
-struct matrix distribute_data(const int N, int (*matrix)[N]) {
+/**
+ * Set up this rank's slab and fill its block and a `halo`-deep ghost ring,
+ * either from the master's matrix (Scatterv) or, if input isn't NULL,
+ * straight from the image file (read_block()).
+ */
+struct slab distribute_data(const int M, const int N, pixel (*matrix)[N], const MPI_Comm grid,
+                            const struct stencil_kernel* const kernel, const int halo,
+                            const char* const input, const struct image* const image) {
+    struct slab slab = make_slab(M, N, grid, kernel, halo);
+
+    if (input != NULL) {
+        read_block(&slab, input, image);
+    }
+    else {
+        struct sendcounts_displacements s_d = generate_sendcounds_and_displacements(grid, M, N, halo);
+        pixel* const sendbuf = pack_blocks(grid, M, N, halo, (const pixel (*)[N])matrix, &s_d);
+
+        pixel* recvbuf;
+        MPI_Datatype recvtype = ghosted_block(&slab, &recvbuf);
+
+        MPI_Scatterv(
+            sendbuf, // packed blocks
+            s_d.sendcounts,
+            s_d.displacements,
+            MPI_PIXEL,
+            recvbuf, // ref to receive buf
+            1, // one (strided) block
+            recvtype,
+            MASTER, // who is doing the sending
+            grid
+        );
+
+        MPI_Type_free(&recvtype);
+        free(sendbuf);
+        free(s_d.sendcounts);
+        free(s_d.displacements);
+    }
+
+    DBG(
+        if (M <= PRINT_MAX && N <= PRINT_MAX) {
+            int my_rank; MPI_Comm_rank(grid, &my_rank);
+            printf("Rank %d submatrix (with ghost ring):\n", my_rank);
+            print_matrix(slab.rows + 2 * halo, slab.cols + 2 * halo, (const pixel (*)[])slab.buf);
+        }
+    )
+
+    mirror_slab(&slab);
+
+    // start the clock.
+    start_time = now();
+
+    return slab;
+}
+
+/**
+ * Set up this rank's slab of an M x N matrix, with nothing in it yet: its
+ * block, its neighbours, and zeroed buffers with a `halo`-deep ghost ring.
+ */
+struct slab make_slab(const int M, const int N, const MPI_Comm grid,
+                      const struct stencil_kernel* const kernel, const int halo) {
     // This worker's rank
-    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    int my_rank; MPI_Comm_rank(grid, &my_rank);
     // Total number of ranks.
-    int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    int num_ranks; MPI_Comm_size(grid, &num_ranks);
 
     DBG(printf("rank %d of %d checking in\n", my_rank, num_ranks);)
 
-    const int M = N; // stay consistent with MxN matrix 
-    const int num_elems = M * N;
+    const int H = halo;
 
-    // Number of elements to send to each processor, assuming it divides evenly.
-    const int num_elems_per_worker = num_elems / num_ranks; // N is num elems per row
-    // Number of rows to send to each processor, assuming they can be divided evenly.
-    const int num_rows_per_worker = M / num_ranks;
-    DBG(printf("num_elems_per_worker=%d\n", num_elems_per_worker);)
+    struct slab slab = { .kernel = kernel, .halo = H, .M = M, .N = N, .grid = grid };
+    block_of(grid, my_rank, M, N, 0, &slab.first_row, &slab.rows, &slab.first_col, &slab.cols);
 
-    struct sendcounts_displacements s_d = generate_sendcounds_and_displacements(num_ranks, M, N, num_rows_per_worker);
-    int* const sendcounts = s_d.sendcounts;
-    int* const displacements = s_d.displacements;
-
-    // Each buffer size varies based off what was allotted for this rank.
-    const int recvbuf_size = sendcounts[my_rank];
-    DBG(printf("rank %d recvbuf_size = %d\n", my_rank, recvbuf_size);)
+    // Neighbours in the grid. Grid rows/cols past the end of a small matrix
+    // own nothing; they're always at the bottom/right, so a neighbour there
+    // is treated as the edge.
+    MPI_Cart_shift(grid, 0, 1, &slab.up, &slab.down);
+    MPI_Cart_shift(grid, 1, 1, &slab.left, &slab.right);
+    if (slab.rows == 0 || slab.cols == 0) {
+        slab.up = slab.down = slab.left = slab.right = MPI_PROC_NULL;
+    }
+    if (slab.first_row + slab.rows == M) {
+        slab.down = MPI_PROC_NULL;
+    }
+    if (slab.first_col + slab.cols == N) {
+        slab.right = MPI_PROC_NULL;
+    }
 
-    int (* const recvbuf)[N] = malloc(recvbuf_size * sizeof **recvbuf);
-    if(recvbuf == NULL) {
-        printf("ERROR: Couldn't allocate recvbuf.\n");
+    // A neighbour's ghost cells all come from this block, so it has to be
+    // at least as deep as the ghost ring.
+    if ((slab.rows < H && (slab.up != MPI_PROC_NULL || slab.down != MPI_PROC_NULL)) ||
+        (slab.cols < H && (slab.left != MPI_PROC_NULL || slab.right != MPI_PROC_NULL))) {
+        printf("ERROR: Rank %d's %d x %d block is thinner than its ghost ring (%d deep). "
+               "Use fewer ranks or fewer passes per exchange.\n",
+               my_rank, slab.rows, slab.cols, H);
         MPI_Abort(MPI_COMM_WORLD, 3);
     }
 
-    MPI_Scatterv(
-        matrix, // ref to original data
-        sendcounts,
-        displacements,
-        MPI_INT,
-        recvbuf, // ref to receive buf
-        recvbuf_size, // number of elements in receive buffer
-        MPI_INT,
-        MASTER, // who is doing the sending
-        MPI_COMM_WORLD
-    );
+    // Owned block plus the ghost ring. Zeroed so the unused ghost cells at
+    // the edges of the matrix are defined when whole rows are exchanged.
+    const int W = slab.cols + 2 * H;
+    const size_t slab_elems = (size_t)(slab.rows + 2 * H) * W;
+    slab.buf = malloc(slab_elems * sizeof(pixel));
+    slab.next = malloc(slab_elems * sizeof(pixel));
+    if (slab.buf == NULL || slab.next == NULL) {
+        printf("ERROR: Couldn't allocate slab.\n");
+        MPI_Abort(MPI_COMM_WORLD, 3);
+    }
 
-    // start the clock.
-    start_time = now();
+    // Each thread zeroes the rows it filters every pass (see filter_block()).
+    // That's the first touch, so on a NUMA node those pages end up in the
+    // memory next to the thread's core.
+    #pragma omp parallel
+    {
+        int first, n;
+        split_rows(slab.rows + 2 * H, omp_get_num_threads(), omp_get_thread_num(), &first, &n);
+        memset((pixel*)slab.buf + (size_t)first * W, 0, (size_t)n * W * sizeof(pixel));
+        memset((pixel*)slab.next + (size_t)first * W, 0, (size_t)n * W * sizeof(pixel));
+    }
 
-    // Done with these (?)
-    free(sendcounts);
-    free(displacements);
+    MPI_Type_vector(slab.rows, H, W, MPI_PIXEL, &slab.column);
+    MPI_Type_commit(&slab.column);
 
-    return (struct matrix) {
-        recvbuf,
-        recvbuf_size,
-        .M = M,
-        .N = N
-    };
+    return slab;
 }
 
 /**
-* Perform the weighted-averaging filter.
-* For each element in the matrix, compute
-* the average of it and its 8 surrounding
-* neighbors.
-*
-* Note: Processing of top, bottom, left, and right edges is not required.
-*/
-struct matrix mask_operation(int N, const int worker_submatrix_size, int (*worker_submatrix)[N]) {
-    int my_rank;
-    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
-    int num_ranks;
-    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
-
-    // Get num rows, but round up to nearest row.
-    const int M = (worker_submatrix_size + (N - 1)) / N;
-
-    printf("Rank %d:\n", my_rank);
-    printf("worker submatrix size: %d\n", worker_submatrix_size);
-    printf("N: %d\n", N);
-    DBG(print_matrix(M, N, (const int (*)[])worker_submatrix);)
-
-    
-
-    // Get the coords of which results need to be calculated.
-    // The first and last rows are only used for neighbor calculations.
-    const int startx = 1;
-    const int endx = M - 1;
-    const int resulting_num_rows = endx - startx;
-    // First and last columns skipped for same reason.
-    const int starty = 1;
-    const int endy = N - 1; 
-    const int resulting_num_cols = N; // Preserve same number of cols as before
-
-    // Create the output subatrix. Make it 2 rows smaller than 
-    // the incoming one since we don't need those two rows.
-    int (*results)[resulting_num_cols] = calloc(resulting_num_rows * resulting_num_cols, sizeof(int));
-    if (results == NULL) {
-        printf("ERROR: Couldn't allocate results.\n");
-        MPI_Abort(MPI_COMM_WORLD, 4);
-    }
-
-    for(int x = startx; x < endx; x++) {
-        for(int y = starty; y < endy; y++) {
-            const int data = worker_submatrix[x][y];
-            // DBG(printf("[rank %d] Working on submat[%d][%d] (which is %d)...\n", my_rank, x, y, data);)
-
-            // Add the 3x3 square of neighbors (hence "nx" "ny") together
-            int sum = 0;
-            for(int nx = x - 1; nx <= x + 1; nx++) {
-                for(int ny = y - 1; ny <= y + 1; ny++) {
-                    sum += data;
-                }
-            }
-
-            const int average = sum / 10;
+ * Pack each rank's block of the master's matrix, with its `halo`-deep
+ * ghost ring, one after the other for a scatter (see
+ * generate_sendcounds_and_displacements()). NULL on the other ranks.
+ */
+pixel* pack_blocks(const MPI_Comm grid, const int M, const int N, const int halo, const pixel (*matrix)[N],
+                   const struct sendcounts_displacements* const s_d) {
+    int my_rank; MPI_Comm_rank(grid, &my_rank);
+    int num_ranks; MPI_Comm_size(grid, &num_ranks);
 
-            // Shift one row up, but maintain the column relative to the original.
-            results[x-1][y] = average; // Save to results
+    if (my_rank != MASTER) {
+        return NULL;
+    }
 
-            // DBG(printf("[rank %d] Average for tile: %d\n", my_rank, results[x-1][y-1]);)
+    const int* const sendcounts = s_d->sendcounts;
+    const int* const displacements = s_d->displacements;
+    pixel* const sendbuf = malloc(((size_t)displacements[num_ranks - 1] + sendcounts[num_ranks - 1]) * sizeof(pixel));
+    if (sendbuf == NULL) {
+        printf("ERROR: Couldn't allocate sendbuf.\n");
+        MPI_Abort(MPI_COMM_WORLD, 3);
+    }
 
-        } // end of for c
-    } // end of for r
+    for (int rank = 0; rank < num_ranks; rank++) {
+        int first_row, rows, first_col, cols;
+        block_of(grid, rank, M, N, halo, &first_row, &rows, &first_col, &cols);
 
-    DBG(printf("[rank %d] resulting matrix:\n", my_rank);)
-    DBG(print_matrix(resulting_num_rows, resulting_num_cols, (const int (*)[])results);)
+        pixel* packed = &sendbuf[displacements[rank]];
+        for (int r = 0; r < rows; r++) {
+            memcpy(packed, &matrix[first_row + r][first_col], cols * sizeof(pixel));
+            packed += cols;
+        }
+    }
 
-    return (struct matrix) {
-        results,
-        resulting_num_rows * resulting_num_cols,
-        .M = resulting_num_rows,
-        .N = resulting_num_cols
-    };
+    return sendbuf;
 }
 
 /**
-*
-*/
-void collect_results(const int M, const int N, struct matrix worker_submatrix) {
+ * The (committed) type this rank's ghosted block arrives as, with where it
+ * starts in slab->buf, so a scatter puts it straight into place. The ghost
+ * ring is only filled on sides that have a neighbour.
+ */
+MPI_Datatype ghosted_block(const struct slab* const slab, pixel** const recvbuf) {
+    int my_rank; MPI_Comm_rank(slab->grid, &my_rank);
 
-    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
-    int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
 
-    // Number of rows to send to each processor, assuming they can be divided evenly.
-    const int num_rows_per_worker = M / num_ranks;
-    
-    // TODO pass these around so we don't need to regenerate them.
-    // TODO this probably won't work. we may need to choose different offsets. Not sure. Maybe not.
-    struct sendcounts_displacements s_d = generate_sendcounds_and_displacements(num_ranks, M, N, num_rows_per_worker);
-    const int* const sendcounts = s_d.sendcounts;
-    const int* const displs = s_d.displacements;
+    int ghost_first_row, ghost_rows, ghost_first_col, ghost_cols;
+    block_of(slab->grid, my_rank, slab->M, slab->N, H, &ghost_first_row, &ghost_rows, &ghost_first_col, &ghost_cols);
+    pixel (* const buf)[W] = slab->buf;
+    *recvbuf = &buf[H - (slab->first_row - ghost_first_row)][H - (slab->first_col - ghost_first_col)];
 
-    int (*result_matrix)[N] = malloc(sizeof(int[M][N]));
-    if (result_matrix == NULL) {
-        printf("ERROR: Couldn't malloc result_matrix.\n");
-        MPI_Abort(MPI_COMM_WORLD, 5);
-    }
+    MPI_Datatype recvtype;
+    MPI_Type_vector(ghost_rows, ghost_cols, W, MPI_PIXEL, &recvtype);
+    MPI_Type_commit(&recvtype);
+    DBG(printf("rank %d recv block = %d x %d\n", my_rank, ghost_rows, ghost_cols);)
 
-    MPI_Gatherv(
-        worker_submatrix.buf, // worker matrix to be sent to master.
-        sendcounts[my_rank], 
-        MPI_INT,
-        result_matrix, // master's collection buffer
-        sendcounts,
-        displs,
-        MPI_INT,
-        MASTER,
-        MPI_COMM_WORLD
-    );
+    return recvtype;
+}
 
-    stop_time = now();
+/**
+ * Copy a freshly filled buf into next.
+ * The outer `radius` rows and cols of the matrix are never filtered, so
+ * once both buffers hold them they can be left alone.
+ */
+void mirror_slab(const struct slab* const slab) {
+    const int W = slab->cols + 2 * slab->halo;
+
+    #pragma omp parallel
+    {
+        int first, n;
+        split_rows(slab->rows + 2 * slab->halo, omp_get_num_threads(), omp_get_thread_num(), &first, &n);
+        memcpy((pixel*)slab->next + (size_t)first * W, (pixel*)slab->buf + (size_t)first * W, (size_t)n * W * sizeof(pixel));
+    }
+}
 
-    // Non-master ranks are done.
-    if (my_rank != MASTER) {
-        return;
+/**
+ * Run `iterations` passes of the slab's filter, refreshing the ghost ring
+ * every `per_exchange` passes (see temporal_block()).
+ */
+void filter_passes(struct slab* const slab, const int iterations, const int per_exchange, const enum exchange exchange) {
+    // Persistent requests are bound to a buffer, and buf/next swap every
+    // pass, so there is one set per buffer.
+    MPI_Request halo_requests[2][8];
+    if (exchange == EXCHANGE_PERSISTENT) {
+        init_persistent_halos(slab, halo_requests);
     }
+    const void* const first_buf = slab->buf;
+
+    for (int i = 0; i < iterations; i += per_exchange) {
+        // The scatter already filled the ghost cells for the first pass.
+        // Persistent exchanges run behind the interior of a single pass
+        // (see mask_operation()).
+        MPI_Request* requests = NULL;
+        if (i > 0) {
+            if (exchange == EXCHANGE_PERSISTENT) {
+                requests = halo_requests[slab->buf == first_buf ? 0 : 1];
+            }
+            else {
+                exchange_halos(slab);
+            }
+        }
 
-    printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
-    printf("Final result:\n");
-    print_matrix(M-2, N, (const int (*)[]) result_matrix);
-    printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        if (per_exchange == 1) {
+            mask_operation(slab, requests);
+            continue;
+        }
 
-    double elapsed = tdiff(start_time, stop_time);
-    printf("Total elapsed time: %f\n", elapsed);
+        if (requests != NULL) {
+            // Columns, then rows (see exchange_halos()).
+            MPI_Startall(4, requests);
+            MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+            MPI_Startall(4, requests + 4);
+            MPI_Waitall(4, requests + 4, MPI_STATUSES_IGNORE);
+        }
+        const int steps = (iterations - i < per_exchange) ? iterations - i : per_exchange;
+        temporal_block(slab, steps);
+    }
 
-    printf("Goodbye.\n");
+    if (exchange == EXCHANGE_PERSISTENT) {
+        for (int b = 0; b < 2; b++) {
+            for (int r = 0; r < 8; r++) {
+                MPI_Request_free(&halo_requests[b][r]);
+            }
+        }
+    }
 }
 
-//------------------------------
-// Performance profiling
-//------------------------------
-double tdiff(const struct timespec start, const struct timespec stop) {
-    return ( stop.tv_sec - start.tv_sec ) + ( stop.tv_nsec - start.tv_nsec ) / 1E9;
+/**
+* Apply the filter to this rank's block (by default the weighted-averaging
+* filter: each element becomes the weighted average of it (weight 2) and
+* its 8 surrounding neighbors (weight 1),
+*   e' = (a + b + c + d + 2e + f + g + h + i) / 10).
+*
+* Note: Processing of top, bottom, left, and right edges is not required.
+* The outer `radius` rows and columns of the matrix have no full
+* neighbourhood; they're left as they are (both buffers got them in
+* distribute_data()) so that passes can be repeated.
+*
+* halo_requests: the persistent halo exchange for slab->buf (see
+* init_persistent_halos()), or NULL if the ghost cells are already fresh.
+* The exchange runs while the threads filter the interior cells, which
+* only read owned cells: half the interior behind the column exchange,
+* half behind the row exchange. The cells within `radius` of the block's
+* sides are filtered once the ghost cells have arrived.
+*/
+void mask_operation(struct slab* const slab, MPI_Request* const halo_requests) {
+    const int H = slab->halo;
+    const int R = slab->kernel->radius;
+    const int rows = slab->rows, cols = slab->cols;
+
+    // Owned cells are [H, H + rows) x [H, H + cols) in the slab; the rest
+    // are ghosts. Work out which of them have a full neighbourhood.
+    const int skip_top = (slab->first_row < R) ? R - slab->first_row : 0;
+    const int skip_left = (slab->first_col < R) ? R - slab->first_col : 0;
+    const int bottom_edge = slab->M - R - slab->first_row; // owned rows before the bottom edge
+    const int right_edge = slab->N - R - slab->first_col;
+    const int x_start = H + skip_top;
+    const int x_end = H + ((bottom_edge < rows) ? bottom_edge : rows); // exclusive
+    const int y_start = H + skip_left;
+    const int y_end = H + ((right_edge < cols) ? right_edge : cols);
+
+    // The interior: cells whose neighbourhood has no ghost cells in it.
+    // Clamped so the interior is empty rather than inverted when the block
+    // is thin, and so the ring around it stays inside [x_start, x_end) x
+    // [y_start, y_end): the edge cells are only in next once.
+    int ix0 = (x_start > H + R) ? x_start : H + R;
+    int iy0 = (y_start > H + R) ? y_start : H + R;
+    ix0 = (ix0 < x_end) ? ix0 : x_end;
+    iy0 = (iy0 < y_end) ? iy0 : y_end;
+    int ix1 = (x_end < H + rows - R) ? x_end : H + rows - R; // exclusive
+    int iy1 = (y_end < H + cols - R) ? y_end : H + cols - R;
+    ix1 = (ix1 > ix0) ? ix1 : ix0;
+    iy1 = (iy1 > iy0) ? iy1 : iy0;
+    const int imid = ix0 + (ix1 - ix0) / 2;
+
+    if (halo_requests != NULL) {
+        // Columns, then rows (see exchange_halos()).
+        MPI_Startall(4, halo_requests);
+        filter_block(slab, ix0, imid, iy0, iy1);
+        MPI_Waitall(4, halo_requests, MPI_STATUSES_IGNORE);
+
+        MPI_Startall(4, halo_requests + 4);
+        filter_block(slab, imid, ix1, iy0, iy1);
+        MPI_Waitall(4, halo_requests + 4, MPI_STATUSES_IGNORE);
+    }
+    else {
+        filter_block(slab, ix0, ix1, iy0, iy1);
+    }
+
+    // The ring around the interior.
+    filter_block(slab, x_start, ix0, y_start, y_end);  // top
+    filter_block(slab, ix1, x_end, y_start, y_end);    // bottom
+    filter_block(slab, ix0, ix1, y_start, iy0);        // left
+    filter_block(slab, ix0, ix1, iy1, y_end);          // right
+
+    // This pass's output is the next pass's input.
+    void* const tmp = slab->buf;
+    slab->buf = slab->next;
+    slab->next = tmp;
+}
+
+/**
+* Filter the cells [x0, x1) x [y0, y1) of the slab (slab coordinates) from
+* buf into next, across the rank's threads.
+* Every thread always takes the same band of slab rows, the one it zeroed
+* in distribute_data(), so its rows stay in its NUMA node's memory and,
+* pass to pass, in its own cache.
+*/
+void filter_block(const struct slab* const slab, const int x0, const int x1, const int y0, const int y1) {
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    const pixel (* const in)[W] = slab->buf;
+    pixel (* const out)[W] = slab->next;
+
+    #pragma omp parallel
+    {
+        int first, n;
+        split_rows(slab->rows + 2 * H, omp_get_num_threads(), omp_get_thread_num(), &first, &n);
+        const int lo = (first > x0) ? first : x0;
+        const int hi = (first + n < x1) ? first + n : x1;
+
+        if (lo < hi) {
+            stencil_apply(slab->kernel, hi - lo, y1 - y0, &in[lo][y0], W, &out[lo][y0], W);
+        }
+    }
+}
+
+/**
+* `steps` passes of the filter on one fill of the ghost ring, which has to
+* be steps * radius deep: one halo exchange for the lot instead of one per
+* pass.
+*
+* Pass t (1..steps) can be filtered out to (steps - t) * radius cells into
+* the ghost ring, because its inputs reach one radius further. So each pass
+* covers a slightly smaller region, down to the owned block on the last
+* pass. The ring cells are the neighbours' too; recomputing them is the
+* price of the fewer messages.
+*
+* Each thread keeps the band of slab rows it has in filter_block(). First
+* it filters everything in its band that doesn't need another band's rows:
+* pass t stops t * radius rows short of each edge it shares with another
+* thread. The passes sweep down the band together as a skewed wavefront of
+* TEMPORAL_TILE-row chunks: chunk c of pass t stops `radius` rows above
+* chunk c of pass t-1, the last row its inputs need. Each chunk is filtered
+* while its inputs are still in cache, so the band goes through memory
+* once per block instead of once per pass. Then, after the block's only
+* barrier, each thread fills in the wedge over the top edge of its band,
+* 2 * t * radius rows of pass t. buf and next are enough: pass t+1 only
+* overwrites rows of pass t-1 that pass t is already past.
+*
+* The wedges need bands at least (2 * steps + 1) * radius rows deep, so a
+* slab too thin for that is split into fewer, deeper bands.
+*/
+void temporal_block(struct slab* const slab, const int steps) {
+    const int H = slab->halo;
+    const int R = slab->kernel->radius;
+    const int W = slab->cols + 2 * H;
+    const int B = TEMPORAL_TILE;
+    pixel* const bufs[2] = {slab->buf, slab->next};
+
+    if (slab->rows <= 0 || slab->cols <= 0) {
+        return;
+    }
+
+    // Pass t's region, never into the outer R rows/cols of the matrix
+    // (slab coordinates).
+    int lo[steps + 1], hi[steps + 1], y0[steps + 1], y1[steps + 1];
+    for (int t = 1; t <= steps; t++) {
+        const int reach = (steps - t) * R;
+        lo[t] = ((slab->first_row - reach > R) ? slab->first_row - reach : R) - slab->first_row + H;
+        hi[t] = ((slab->first_row + slab->rows + reach < slab->M - R) ?
+                 slab->first_row + slab->rows + reach : slab->M - R) - slab->first_row + H;
+        y0[t] = ((slab->first_col - reach > R) ? slab->first_col - reach : R) - slab->first_col + H;
+        y1[t] = ((slab->first_col + slab->cols + reach < slab->N - R) ?
+                 slab->first_col + slab->cols + reach : slab->N - R) - slab->first_col + H;
+    }
+
+    #pragma omp parallel
+    {
+        const int fit = (slab->rows + 2 * H) / ((2 * steps + 1) * R);
+        const int bands = (omp_get_num_threads() < fit) ? omp_get_num_threads() : (fit > 1) ? fit : 1;
+        const int band = omp_get_thread_num();
+        int top = 0, n = 0;
+        if (band < bands) {
+            split_rows(slab->rows + 2 * H, bands, band, &top, &n);
+        }
+
+        const int chunks = (n + steps * R + B - 1) / B;
+        for (int c = 1; n > 0 && c <= chunks; c++) {
+            for (int t = 1; t <= steps; t++) {
+                // This chunk's rows of pass t, short of the shared edges.
+                int a = top + (c - 1) * B - t * R;
+                int b = top + c * B - t * R;
+                const int a_min = (band > 0 && top + t * R > lo[t]) ? top + t * R : lo[t];
+                const int b_max = (band < bands - 1 && top + n - t * R < hi[t]) ? top + n - t * R : hi[t];
+                a = (a < a_min) ? a_min : a;
+                b = (b > b_max) ? b_max : b;
+
+                if (a < b && y0[t] < y1[t]) {
+                    const pixel (* const in)[W] = (const pixel (*)[W])bufs[(t - 1) % 2];
+                    pixel (* const out)[W] = (pixel (*)[W])bufs[t % 2];
+                    stencil_apply(slab->kernel, b - a, y1[t] - y0[t], &in[a][y0[t]], W, &out[a][y0[t]], W);
+                }
+            }
+        }
+
+        // The wedges read the rows either side of them that the bands
+        // just filtered.
+        #pragma omp barrier
+
+        if (band > 0 && band < bands) {
+            for (int t = 1; t <= steps; t++) {
+                const int a = (top - t * R > lo[t]) ? top - t * R : lo[t];
+                const int b = (top + t * R < hi[t]) ? top + t * R : hi[t];
+
+                if (a < b && y0[t] < y1[t]) {
+                    const pixel (* const in)[W] = (const pixel (*)[W])bufs[(t - 1) % 2];
+                    pixel (* const out)[W] = (pixel (*)[W])bufs[t % 2];
+                    stencil_apply(slab->kernel, b - a, y1[t] - y0[t], &in[a][y0[t]], W, &out[a][y0[t]], W);
+                }
+            }
+        }
+    }
+
+    // The last pass wrote into bufs[steps % 2].
+    if (steps % 2 == 1) {
+        slab->buf = bufs[1];
+        slab->next = bufs[0];
+    }
+}
+
+/**
+ * Refresh the ghost ring from the neighbouring ranks.
+ *
+ * Columns go first (owned rows only, as a strided MPI_Type_vector), then
+ * whole rows including the ghost columns just received. That carries the
+ * corner cells to the diagonal neighbours without any extra messages.
+ * Each message is `halo` rows or columns deep.
+ * MPI_PROC_NULL neighbours at the edges make those transfers no-ops.
+ */
+void exchange_halos(const struct slab* const slab) {
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    const int rows = slab->rows, cols = slab->cols;
+    pixel (* const buf)[W] = slab->buf;
+
+    // First owned columns left, right ghost columns from the right.
+    MPI_Sendrecv(&buf[H][H], 1, slab->column, slab->left, HALO_LEFT,
+                 &buf[H][cols + H], 1, slab->column, slab->right, HALO_LEFT,
+                 slab->grid, MPI_STATUS_IGNORE);
+
+    // Last owned columns right, left ghost columns from the left.
+    MPI_Sendrecv(&buf[H][cols], 1, slab->column, slab->right, HALO_RIGHT,
+                 &buf[H][0], 1, slab->column, slab->left, HALO_RIGHT,
+                 slab->grid, MPI_STATUS_IGNORE);
+
+    // First owned rows up, bottom ghost rows from below.
+    MPI_Sendrecv(buf[H], H * W, MPI_PIXEL, slab->up, HALO_UP,
+                 buf[rows + H], H * W, MPI_PIXEL, slab->down, HALO_UP,
+                 slab->grid, MPI_STATUS_IGNORE);
+
+    // Last owned rows down, top ghost rows from above.
+    MPI_Sendrecv(buf[rows], H * W, MPI_PIXEL, slab->down, HALO_DOWN,
+                 buf[0], H * W, MPI_PIXEL, slab->up, HALO_DOWN,
+                 slab->grid, MPI_STATUS_IGNORE);
+}
+
+/**
+ * Set up the same transfers as exchange_halos() as persistent requests,
+ * one set for each of the slab's two buffers.
+ * requests[0] works on slab->buf, requests[1] on slab->next.
+ * Requests 0-3 are the column exchange and 4-7 the row exchange; the
+ * rows must wait for the columns to finish.
+ */
+void init_persistent_halos(const struct slab* const slab, MPI_Request requests[2][8]) {
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    const int rows = slab->rows, cols = slab->cols;
+    void* const buffers[2] = {slab->buf, slab->next};
+
+    for (int b = 0; b < 2; b++) {
+        pixel (* const buf)[W] = buffers[b];
+        MPI_Request* const r = requests[b];
+
+        MPI_Recv_init(&buf[H][cols + H], 1, slab->column, slab->right, HALO_LEFT, slab->grid, &r[0]);
+        MPI_Recv_init(&buf[H][0], 1, slab->column, slab->left, HALO_RIGHT, slab->grid, &r[1]);
+        MPI_Send_init(&buf[H][H], 1, slab->column, slab->left, HALO_LEFT, slab->grid, &r[2]);
+        MPI_Send_init(&buf[H][cols], 1, slab->column, slab->right, HALO_RIGHT, slab->grid, &r[3]);
+
+        MPI_Recv_init(buf[rows + H], H * W, MPI_PIXEL, slab->down, HALO_UP, slab->grid, &r[4]);
+        MPI_Recv_init(buf[0], H * W, MPI_PIXEL, slab->up, HALO_DOWN, slab->grid, &r[5]);
+        MPI_Send_init(buf[H], H * W, MPI_PIXEL, slab->up, HALO_UP, slab->grid, &r[6]);
+        MPI_Send_init(buf[rows], H * W, MPI_PIXEL, slab->down, HALO_DOWN, slab->grid, &r[7]);
+    }
+}
+
+/**
+* Gather every rank's owned block back into the master's matrix.
+*/
+void collect_results(const int M, const int N, const struct slab* const slab, pixel (*matrix)[N]) {
+
+    int my_rank; MPI_Comm_rank(slab->grid, &my_rank);
+
+    // Only owned cells come back, so there's no overlap between ranks.
+    struct sendcounts_displacements s_d = generate_sendcounds_and_displacements(slab->grid, M, N, 0);
+    const int* const sendcounts = s_d.sendcounts;
+    const int* const displs = s_d.displacements;
+
+    // The owned block, without the ghost ring.
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    const pixel (* const buf)[W] = slab->buf;
+    MPI_Datatype block;
+    MPI_Type_vector(slab->rows, slab->cols, W, MPI_PIXEL, &block);
+    MPI_Type_commit(&block);
+
+    pixel* recvbuf = NULL;
+    if (my_rank == MASTER) {
+        recvbuf = malloc(sizeof(pixel[M][N]));
+        if (recvbuf == NULL) {
+            printf("ERROR: Couldn't malloc recvbuf.\n");
+            MPI_Abort(MPI_COMM_WORLD, 5);
+        }
+    }
+
+    MPI_Gatherv(
+        &buf[H][H], // worker block to be sent to master.
+        1,
+        block,
+        recvbuf, // master's collection buffer (packed blocks)
+        sendcounts,
+        displs,
+        MPI_PIXEL,
+        MASTER,
+        slab->grid
+    );
+
+    stop_time = now();
+
+    MPI_Type_free(&block);
+
+    // Non-master ranks are done.
+    if (my_rank != MASTER) {
+        free(s_d.sendcounts);
+        free(s_d.displacements);
+        return;
+    }
+
+    // Unpack the blocks over the master's input matrix.
+    unpack_blocks(slab->grid, M, N, recvbuf, displs, matrix);
+
+    free(recvbuf);
+    free(s_d.sendcounts);
+    free(s_d.displacements);
+
+    if (M <= PRINT_MAX && N <= PRINT_MAX) {
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        printf("Final result:\n");
+        print_matrix(M, N, (const pixel (*)[]) matrix);
+        printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+    }
+
+    long long checksum = 0;
+    for (int r = 0; r < M; r++) {
+        for (int c = 0; c < N; c++) {
+            checksum += matrix[r][c];
+        }
+    }
+    printf("Checksum: %lld\n", checksum);
+
+    double elapsed = tdiff(start_time, stop_time);
+    printf("Total elapsed time: %f\n", elapsed);
+
+    printf("Goodbye.\n");
+}
+
+/**
+ * Copy the owned blocks a gather packed one after the other (halo 0, see
+ * generate_sendcounds_and_displacements()) into place in the master's
+ * matrix.
+ */
+void unpack_blocks(const MPI_Comm grid, const int M, const int N, const pixel* const recvbuf, const int* const displs,
+                   pixel (*matrix)[N]) {
+    int num_ranks; MPI_Comm_size(grid, &num_ranks);
+
+    for (int rank = 0; rank < num_ranks; rank++) {
+        int first_row, rows, first_col, cols;
+        block_of(grid, rank, M, N, 0, &first_row, &rows, &first_col, &cols);
+
+        const pixel* packed = &recvbuf[displs[rank]];
+        for (int r = 0; r < rows; r++) {
+            memcpy(&matrix[first_row + r][first_col], packed, cols * sizeof(pixel));
+            packed += cols;
+        }
+    }
+}
+
+//------------------------------
+// Image I/O
+//------------------------------
+/**
+ * Read a PGM image's header. The master parses it and broadcasts the
+ * result; the pixels themselves are only ever read by the ranks that own
+ * them (read_block()).
+ * The file's pixel size has to match the build's (PIXEL_BITS).
+ */
+struct image read_image_header(const char* const path) {
+    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    long long header[4] = {0, 0, 0, 0}; // M, N, maxval, offset
+    if (my_rank == MASTER) {
+        FILE* const f = fopen(path, "rb");
+        if (f == NULL) {
+            printf("ERROR: Couldn't open %s.\n", path);
+            MPI_Abort(MPI_COMM_WORLD, 6);
+        }
+
+        const struct image image = parse_image_header(f, path);
+        header[0] = image.M;
+        header[1] = image.N;
+        header[2] = image.maxval;
+        header[3] = image.offset;
+        fclose(f);
+    }
+
+    MPI_Bcast(header, 4, MPI_LONG_LONG, MASTER, MPI_COMM_WORLD);
+
+    return (struct image) {
+        .M = (int)header[0],
+        .N = (int)header[1],
+        .maxval = (int)header[2],
+        .offset = (MPI_Offset)header[3],
+    };
+}
+
+/**
+ * Parse the header of an open PGM image, leaving f at its first pixel.
+ * Aborts if it isn't a binary PGM image with the build's pixel size.
+ */
+struct image parse_image_header(FILE* const f, const char* const path) {
+    char magic[3] = {0};
+    int cols = 0, rows = 0, maxval = 0;
+    const int ok = fread(magic, 1, 2, f) == 2 && strcmp(magic, "P5") == 0 &&
+                   pgm_number(f, &cols) && pgm_number(f, &rows) && pgm_number(f, &maxval) &&
+                   isspace(fgetc(f)); // exactly one whitespace character before the pixels
+    if (!ok || cols < 1 || rows < 1 || maxval < 1 || maxval > UINT16_MAX) {
+        printf("ERROR: %s isn't a binary (P5) PGM image.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    const int bytes = (maxval < 256) ? 1 : 2;
+    if (bytes != (int)sizeof(pixel)) {
+        printf("ERROR: %s has %d-bit pixels. Build with PIXEL_BITS=%d.\n", path, 8 * bytes, 8 * bytes);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    return (struct image) { .M = rows, .N = cols, .maxval = maxval, .offset = ftell(f) };
+}
+
+/**
+ * Read the next number of a PGM header, skipping whitespace and
+ * # comments before it. Returns 0 if there isn't one.
+ */
+int pgm_number(FILE* const f, int* const value) {
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(f)) != EOF && c != '\n') {}
+        }
+        else if (!isspace(c)) {
+            ungetc(c, f);
+            break;
+        }
+    }
+    return fscanf(f, "%d", value) == 1;
+}
+
+/**
+ * Make the file look like just one block of the MxN image, starting at
+ * byte `offset`, so a collective read/write of the block touches nothing
+ * else. Ranks without a block get a plain view and transfer nothing.
+ */
+void set_block_view(const MPI_File file, const MPI_Offset offset, const int M, const int N,
+                    const int first_row, const int rows, const int first_col, const int cols) {
+    MPI_Datatype filetype = MPI_PIXEL;
+    if (rows > 0 && cols > 0) {
+        const int sizes[2] = {M, N};
+        const int subsizes[2] = {rows, cols};
+        const int starts[2] = {first_row, first_col};
+        MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_PIXEL, &filetype);
+        MPI_Type_commit(&filetype);
+    }
+
+    MPI_File_set_view(file, offset, MPI_PIXEL, filetype, "native", MPI_INFO_NULL);
+
+    if (filetype != MPI_PIXEL) {
+        MPI_Type_free(&filetype);
+    }
+}
+
+/**
+ * 16-bit PGM pixels are big-endian; swap them to or from host order.
+ * (8-bit pixels have no byte order.)
+ */
+void swap_pixel_bytes(pixel* const p, const size_t n) {
+#if PIXEL_BITS == 16
+    const uint16_t probe = 1;
+    if (*(const uint8_t*)&probe == 0) {
+        return; // big-endian host
+    }
+    for (size_t i = 0; i < n; i++) {
+        p[i] = (pixel)((p[i] >> 8) | (p[i] << 8));
+    }
+#else
+    (void)p;
+    (void)n;
+#endif
+}
+
+/**
+ * Fill this rank's block and ghost ring straight from the image file with
+ * one collective read (MPI_File_read_all through a subarray view), in
+ * place of the master's Scatterv. Same cells as the scatter: the ghost
+ * ring is only filled on sides that have a neighbour.
+ */
+void read_block(const struct slab* const slab, const char* const path, const struct image* const image) {
+    int my_rank; MPI_Comm_rank(slab->grid, &my_rank);
+
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    pixel (* const buf)[W] = slab->buf;
+
+    int ghost_first_row, ghost_rows, ghost_first_col, ghost_cols;
+    block_of(slab->grid, my_rank, slab->M, slab->N, H, &ghost_first_row, &ghost_rows, &ghost_first_col, &ghost_cols);
+    pixel* const recvbuf = &buf[H - (slab->first_row - ghost_first_row)][H - (slab->first_col - ghost_first_col)];
+
+    MPI_File file;
+    if (MPI_File_open(slab->grid, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        printf("ERROR: Rank %d couldn't open %s.\n", my_rank, path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    set_block_view(file, image->offset, slab->M, slab->N, ghost_first_row, ghost_rows, ghost_first_col, ghost_cols);
+
+    MPI_Datatype recvtype;
+    MPI_Type_vector(ghost_rows, ghost_cols, W, MPI_PIXEL, &recvtype);
+    MPI_Type_commit(&recvtype);
+
+    const int count = (ghost_rows > 0 && ghost_cols > 0) ? 1 : 0;
+    MPI_File_read_all(file, recvbuf, count, recvtype, MPI_STATUS_IGNORE);
+
+    MPI_Type_free(&recvtype);
+    MPI_File_close(&file);
+
+    swap_pixel_bytes(slab->buf, (size_t)(slab->rows + 2 * H) * W);
+}
+
+/**
+ * Write the result as a PGM image: the master writes the header, then
+ * every rank writes its owned block in place with one collective write.
+ * Replaces collect_results(), so nobody holds the whole image; the
+ * checksum is reduced from the ranks' blocks instead.
+ */
+void write_image(const struct slab* const slab, const char* const path, const int maxval) {
+    int my_rank; MPI_Comm_rank(slab->grid, &my_rank);
+
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    pixel (* const buf)[W] = slab->buf;
+
+    MPI_File file;
+    if (MPI_File_open(slab->grid, path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        printf("ERROR: Rank %d couldn't open %s.\n", my_rank, path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    const MPI_Offset header_len = write_image_header(file, slab->M, slab->N, maxval);
+
+    long long my_checksum = 0;
+    for (int r = H; r < H + slab->rows; r++) {
+        for (int c = H; c < H + slab->cols; c++) {
+            my_checksum += buf[r][c];
+        }
+    }
+
+    swap_pixel_bytes(slab->buf, (size_t)(slab->rows + 2 * H) * W);
+
+    set_block_view(file, header_len, slab->M, slab->N, slab->first_row, slab->rows, slab->first_col, slab->cols);
+
+    MPI_Datatype block;
+    MPI_Type_vector(slab->rows, slab->cols, W, MPI_PIXEL, &block);
+    MPI_Type_commit(&block);
+
+    const int count = (slab->rows > 0 && slab->cols > 0) ? 1 : 0;
+    MPI_File_write_all(file, &buf[H][H], count, block, MPI_STATUS_IGNORE);
+
+    MPI_Type_free(&block);
+    MPI_File_close(&file);
+
+    stop_time = now();
+
+    long long checksum = 0;
+    MPI_Reduce(&my_checksum, &checksum, 1, MPI_LONG_LONG, MPI_SUM, MASTER, slab->grid);
+
+    if (my_rank == MASTER) {
+        printf("Wrote %s (%d x %d)\n", path, slab->M, slab->N);
+        printf("Checksum: %lld\n", checksum);
+
+        double elapsed = tdiff(start_time, stop_time);
+        printf("Total elapsed time: %f\n", elapsed);
+
+        printf("Goodbye.\n");
+    }
+}
+
+/**
+ * Size an open output file for an MxN PGM image and have the master write
+ * its header. Collective. Returns where the pixels start.
+ */
+MPI_Offset write_image_header(const MPI_File file, const int M, const int N, const int maxval) {
+    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    char header[64];
+    const int header_len = snprintf(header, sizeof header, "P5\n%d %d\n%d\n", N, M, maxval);
+
+    // Cut off whatever an older, bigger file had past the end.
+    MPI_File_set_size(file, header_len + (MPI_Offset)M * N * sizeof(pixel));
+
+    if (my_rank == MASTER) {
+        MPI_File_write_at(file, 0, header, header_len, MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+
+    return header_len;
+}
+
+/**
+ * Read a whole PGM image into the master's memory (batch mode). Returns
+ * the pixels, M x N, and fills in image.
+ */
+pixel* read_pgm(const char* const path, struct image* const image) {
+    FILE* const f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("ERROR: Couldn't open %s.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    *image = parse_image_header(f, path);
+    const size_t n = (size_t)image->M * image->N;
+    pixel* const pixels = malloc(n * sizeof(pixel));
+    if (pixels == NULL) {
+        printf("ERROR: Couldn't allocate %s's pixels.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+    if (fread(pixels, sizeof(pixel), n, f) != n) {
+        printf("ERROR: %s is cut short.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+    fclose(f);
+
+    swap_pixel_bytes(pixels, n);
+    return pixels;
+}
+
+/**
+ * Write a whole image from the master's memory (batch mode). 16-bit pixels
+ * are byte-swapped in place, so pixels is garbage afterwards.
+ */
+void write_pgm(const char* const path, const struct image* const image, pixel* const pixels) {
+    FILE* const f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("ERROR: Couldn't open %s.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    const size_t n = (size_t)image->M * image->N;
+    swap_pixel_bytes(pixels, n);
+    if (fprintf(f, "P5\n%d %d\n%d\n", image->N, image->M, image->maxval) < 0 ||
+        fwrite(pixels, sizeof(pixel), n, f) != n || fclose(f) != 0) {
+        printf("ERROR: Couldn't write %s.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+}
+
+//------------------------------
+// Batches
+//------------------------------
+/**
+ * Filter a batch of images listed in a text file, one "input.pgm
+ * output.pgm" pair per line.
+ *
+ * The images go through a pipeline on the process grid. While the ranks
+ * filter image i, image i+1's blocks are on their way out of the master
+ * (MPI_Iscatterv) and image i-1's are on their way back (MPI_Igatherv),
+ * so the collectives progress behind the filtering (the halo exchanges
+ * drive them). Between filters, the master writes image i-1 and reads
+ * image i+2. So there are at most BATCH_DEPTH images in memory, each
+ * whole on the master and in blocks on the ranks.
+ */
+void batch_filter(const char* const list, const MPI_Comm grid, const struct stencil_kernel* const kernel,
+                  const int iterations, const int per_exchange, const enum exchange exchange) {
+    int my_rank; MPI_Comm_rank(grid, &my_rank);
+
+    // Only the master needs the paths; the others just need to know how
+    // many images there are.
+    int count = 0;
+    char** paths = NULL;
+    if (my_rank == MASTER) {
+        paths = read_batch_list(list, &count);
+    }
+    MPI_Bcast(&count, 1, MPI_INT, MASTER, grid);
+
+    const int halo = per_exchange * kernel->radius;
+    struct batch_image images[BATCH_DEPTH];
+
+    start_time = now();
+
+    // Fill the pipeline: two images read, one of them on its way out.
+    for (int i = 0; i < 2 && i < count; i++) {
+        if (my_rank == MASTER) {
+            batch_load(&images[i], paths[2 * i], paths[2 * i + 1]);
+        }
+    }
+    if (count > 0) {
+        batch_scatter(&images[0], grid, kernel, halo);
+    }
+
+    for (int i = 0; i <= count; i++) {
+        if (i + 1 < count) {
+            batch_scatter(&images[(i + 1) % BATCH_DEPTH], grid, kernel, halo);
+        }
+        if (i < count) {
+            batch_gather(&images[i % BATCH_DEPTH], iterations, per_exchange, exchange);
+        }
+        if (i > 0) {
+            batch_finish(&images[(i - 1) % BATCH_DEPTH]);
+        }
+        if (i + 2 < count && my_rank == MASTER) {
+            batch_load(&images[(i + 2) % BATCH_DEPTH], paths[2 * (i + 2)], paths[2 * (i + 2) + 1]);
+        }
+    }
+
+    stop_time = now();
+
+    if (my_rank == MASTER) {
+        const double elapsed = tdiff(start_time, stop_time);
+        printf("Batch: %d images\n", count);
+        printf("Total elapsed time: %f (%f per image)\n", elapsed, (count > 0) ? elapsed / count : 0.0);
+        printf("Goodbye.\n");
+
+        for (int i = 0; i < 2 * count; i++) {
+            free(paths[i]);
+        }
+        free(paths);
+    }
+}
+
+/**
+ * Read a batch list: pairs of paths, separated by whitespace. Returns
+ * 2 * count paths, input then output.
+ */
+char** read_batch_list(const char* const path, int* const count) {
+    FILE* const f = fopen(path, "r");
+    if (f == NULL) {
+        printf("ERROR: Couldn't open %s.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    int capacity = 16;
+    char** paths = malloc(capacity * sizeof *paths);
+    char input[4096], output[4096];
+    *count = 0;
+    while (paths != NULL && fscanf(f, "%4095s %4095s", input, output) == 2) {
+        if (2 * *count + 2 > capacity) {
+            capacity *= 2;
+            char** const grown = realloc(paths, capacity * sizeof *paths);
+            if (grown == NULL) {
+                free(paths);
+                paths = NULL;
+                break;
+            }
+            paths = grown;
+        }
+        paths[2 * *count] = strdup(input);
+        paths[2 * *count + 1] = strdup(output);
+        if (paths[2 * *count] == NULL || paths[2 * *count + 1] == NULL) {
+            paths = NULL;
+            break;
+        }
+        (*count)++;
+    }
+    if (paths == NULL) {
+        printf("ERROR: Couldn't allocate %s's paths.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+    if (!feof(f)) {
+        printf("ERROR: %s has an input without an output.\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+    fclose(f);
+
+    return paths;
+}
+
+/**
+ * Read a batch image into the master's memory.
+ */
+void batch_load(struct batch_image* const b, const char* const input, const char* const output) {
+    b->input = input;
+    b->output = output;
+    b->pixels = read_pgm(input, &b->image);
+}
+
+/**
+ * Start scattering a batch image that the master has loaded: set up every
+ * rank's slab for it and post the MPI_Iscatterv of the ghosted blocks.
+ * Collective.
+ */
+void batch_scatter(struct batch_image* const b, const MPI_Comm grid, const struct stencil_kernel* const kernel,
+                   const int halo) {
+    int my_rank; MPI_Comm_rank(grid, &my_rank);
+
+    // Images can differ in size, so the others learn it from the master.
+    int size[2] = { 0, 0 };
+    if (my_rank == MASTER) {
+        size[0] = b->image.M;
+        size[1] = b->image.N;
+    }
+    MPI_Bcast(size, 2, MPI_INT, MASTER, grid);
+    const int M = size[0];
+    const int N = size[1];
+
+    b->slab = make_slab(M, N, grid, kernel, halo);
+    b->s_d = generate_sendcounds_and_displacements(grid, M, N, halo);
+    b->packed = pack_blocks(grid, M, N, halo, (const pixel (*)[N])b->pixels, &b->s_d);
+
+    pixel* recvbuf;
+    b->type = ghosted_block(&b->slab, &recvbuf);
+
+    MPI_Iscatterv(b->packed, b->s_d.sendcounts, b->s_d.displacements, MPI_PIXEL,
+                  recvbuf, 1, b->type, MASTER, grid, &b->request);
+}
+
+/**
+ * Filter a batch image once its scatter has arrived, then post the
+ * MPI_Igatherv of the owned blocks back to the master. Collective.
+ */
+void batch_gather(struct batch_image* const b, const int iterations, const int per_exchange,
+                  const enum exchange exchange) {
+    struct slab* const slab = &b->slab;
+    int my_rank; MPI_Comm_rank(slab->grid, &my_rank);
+
+    MPI_Wait(&b->request, MPI_STATUS_IGNORE);
+    MPI_Type_free(&b->type);
+    free(b->packed);
+    free(b->s_d.sendcounts);
+    free(b->s_d.displacements);
+
+    mirror_slab(slab);
+    filter_passes(slab, iterations, per_exchange, exchange);
+
+    // Only owned cells come back.
+    const int M = slab->M;
+    const int N = slab->N;
+    b->s_d = generate_sendcounds_and_displacements(slab->grid, M, N, 0);
+
+    const int H = slab->halo;
+    const int W = slab->cols + 2 * H;
+    pixel (* const buf)[W] = slab->buf;
+    MPI_Type_vector(slab->rows, slab->cols, W, MPI_PIXEL, &b->type);
+    MPI_Type_commit(&b->type);
+
+    b->packed = NULL;
+    if (my_rank == MASTER) {
+        b->packed = malloc((size_t)M * N * sizeof(pixel));
+        if (b->packed == NULL) {
+            printf("ERROR: Couldn't malloc recvbuf.\n");
+            MPI_Abort(MPI_COMM_WORLD, 5);
+        }
+    }
+
+    MPI_Igatherv(&buf[H][H], 1, b->type, b->packed, b->s_d.sendcounts, b->s_d.displacements, MPI_PIXEL,
+                 MASTER, slab->grid, &b->request);
+}
+
+/**
+ * Finish gathering a batch image, have the master write it out, and free
+ * it everywhere.
+ */
+void batch_finish(struct batch_image* const b) {
+    struct slab* const slab = &b->slab;
+    int my_rank; MPI_Comm_rank(slab->grid, &my_rank);
+
+    MPI_Wait(&b->request, MPI_STATUS_IGNORE);
+
+    if (my_rank == MASTER) {
+        // The result goes over the input, which still has the edges.
+        const int N = slab->N;
+        pixel (* const matrix)[N] = (pixel (*)[N])b->pixels;
+        unpack_blocks(slab->grid, slab->M, N, b->packed, b->s_d.displacements, matrix);
+
+        long long checksum = 0;
+        for (size_t i = 0; i < (size_t)slab->M * N; i++) {
+            checksum += b->pixels[i];
+        }
+        write_pgm(b->output, &b->image, b->pixels);
+        printf("Wrote %s (%d x %d) from %s, checksum: %lld\n", b->output, slab->M, N, b->input, checksum);
+
+        free(b->pixels);
+    }
+
+    MPI_Type_free(&b->type);
+    free(b->packed);
+    free(b->s_d.sendcounts);
+    free(b->s_d.displacements);
+    MPI_Type_free(&slab->column);
+    free(slab->buf);
+    free(slab->next);
+}
+
+//------------------------------
+// Streaming
+//------------------------------
+/**
+ * Filter an image that needn't fit in memory, file to file.
+ *
+ * Each rank takes a band of whole rows (split_rows()) and streams it
+ * through memory STREAM_BAND rows at a time (stream_pass()). Neighbouring
+ * rows come from the file, so there's no halo exchange. Memory per rank is
+ * about (4 * STREAM_BAND + 4 * radius) rows, however tall the image is.
+ *
+ * A pass can't write over the file it's reading (other ranks still need
+ * the rows at the edges of its band), so passes alternate between the
+ * output file and a scratch file next to it, arranged so the last pass
+ * lands in the output.
+ */
+void stream_filter(const char* const input, const struct image* const image, const char* const output,
+                   const struct stencil_kernel* const kernel, const int iterations) {
+    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    char scratch[4096];
+    if (snprintf(scratch, sizeof scratch, "%s.tmp", output) >= (int)sizeof scratch) {
+        if (my_rank == MASTER) {
+            printf("ERROR: Output path is too long.\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    // Whichever pass reads the input could otherwise be writing it too.
+    if (my_rank == MASTER &&
+        (same_file(input, output) || same_file(input, scratch) || same_file(output, scratch))) {
+        printf("ERROR: %s, %s and %s must be different files in stream mode.\n", input, output, scratch);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    long long my_checksum = 0;
+    start_time = now();
+
+    const char* src = input;
+    MPI_Offset src_offset = image->offset;
+    for (int pass = 0; pass < iterations; pass++) {
+        const char* const dst = ((iterations - 1 - pass) % 2 == 0) ? output : scratch;
+
+        MPI_File in_file, out_file;
+        if (MPI_File_open(MPI_COMM_WORLD, src, MPI_MODE_RDONLY, MPI_INFO_NULL, &in_file) != MPI_SUCCESS ||
+            MPI_File_open(MPI_COMM_WORLD, dst, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &out_file) != MPI_SUCCESS) {
+            printf("ERROR: Rank %d couldn't open %s or %s.\n", my_rank, src, dst);
+            MPI_Abort(MPI_COMM_WORLD, 6);
+        }
+
+        const MPI_Offset dst_offset = write_image_header(out_file, image->M, image->N, image->maxval);
+
+        stream_pass(in_file, src_offset, out_file, dst_offset, image->M, image->N, kernel,
+                    (pass == iterations - 1) ? &my_checksum : NULL);
+
+        // Closing is collective, so every rank's rows are in dst before
+        // anyone reads it in the next pass.
+        MPI_File_close(&in_file);
+        MPI_File_close(&out_file);
+
+        src = dst;
+        src_offset = dst_offset;
+    }
+
+    if (iterations > 1 && my_rank == MASTER) {
+        MPI_File_delete(scratch, MPI_INFO_NULL);
+    }
+
+    stop_time = now();
+
+    long long checksum = 0;
+    MPI_Reduce(&my_checksum, &checksum, 1, MPI_LONG_LONG, MPI_SUM, MASTER, MPI_COMM_WORLD);
+
+    if (my_rank == MASTER) {
+        const double band_mb = (4.0 * STREAM_BAND + 4.0 * kernel->radius) * image->N * sizeof(pixel) / 1e6;
+        printf("Wrote %s (%d x %d), streamed in bands of %d rows (%.1f MB per rank)\n",
+               output, image->M, image->N, STREAM_BAND, band_mb);
+        printf("Checksum: %lld\n", checksum);
+
+        double elapsed = tdiff(start_time, stop_time);
+        printf("Total elapsed time: %f\n", elapsed);
+
+        printf("Goodbye.\n");
+    }
+}
+
+/**
+ * Whether paths a and b name the same existing file, however they're
+ * spelled (same device and inode).
+ */
+int same_file(const char* const a, const char* const b) {
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/**
+ * One pass over this rank's rows, in_file to out_file.
+ *
+ * Two input slots, each holding a band plus `radius` rows above and below
+ * it (read straight from the file, so a slot never needs rows from another
+ * slot), and two output slots. While band b is filtered, band b+1 is
+ * already being read into the other input slot (MPI_File_iread_at) and
+ * band b-1 is still being written from the other output slot
+ * (MPI_File_iwrite_at).
+ * checksum: if not NULL, the sum of this rank's output pixels is added.
+ */
+void stream_pass(const MPI_File in_file, const MPI_Offset in_offset, const MPI_File out_file, const MPI_Offset out_offset,
+                 const int M, const int N, const struct stencil_kernel* const kernel, long long* const checksum) {
+    int my_rank; MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    int num_ranks; MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    const int H = kernel->radius;
+    const int B = STREAM_BAND;
+
+    int first_row, rows;
+    split_rows(M, num_ranks, my_rank, &first_row, &rows);
+    const int bands = (rows + B - 1) / B;
+
+    pixel* in_slots[2];
+    pixel* out_slots[2];
+    for (int s = 0; s < 2; s++) {
+        in_slots[s] = malloc((size_t)(B + 2 * H) * N * sizeof(pixel));
+        out_slots[s] = malloc((size_t)B * N * sizeof(pixel));
+        if (in_slots[s] == NULL || out_slots[s] == NULL) {
+            printf("ERROR: Couldn't allocate stream buffers.\n");
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+    }
+
+    MPI_Request reads[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    MPI_Request writes[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    int slot_first_row[2] = {0, 0}; // image row held in each input slot's first row
+    int slot_rows[2] = {0, 0};
+
+    for (int b = 0; b <= bands; b++) {
+        // Start reading band b, one ahead of the band being filtered.
+        if (b < bands) {
+            const int s = b % 2;
+            const int x0 = first_row + b * B;
+            const int x1 = (x0 + B < first_row + rows) ? x0 + B : first_row + rows;
+            const int lo = (x0 - H > 0) ? x0 - H : 0;
+            const int hi = (x1 + H < M) ? x1 + H : M;
+            slot_first_row[s] = lo;
+            slot_rows[s] = hi - lo;
+            MPI_File_iread_at(in_file, in_offset + (MPI_Offset)lo * N * sizeof(pixel), in_slots[s],
+                              (hi - lo) * N, MPI_PIXEL, &reads[s]);
+        }
+        if (b == 0) {
+            continue;
+        }
+
+        // Filter band b-1.
+        const int s = (b - 1) % 2;
+        const int x0 = first_row + (b - 1) * B;
+        const int n = (x0 + B < first_row + rows) ? B : first_row + rows - x0;
+
+        MPI_Wait(&reads[s], MPI_STATUS_IGNORE);
+        swap_pixel_bytes(in_slots[s], (size_t)slot_rows[s] * N);
+
+        MPI_Wait(&writes[s], MPI_STATUS_IGNORE); // the slot's previous band is out
+        stream_band(in_slots[s], slot_first_row[s], out_slots[s], x0, n, M, N, kernel);
+
+        if (checksum != NULL) {
+            for (size_t i = 0; i < (size_t)n * N; i++) {
+                *checksum += out_slots[s][i];
+            }
+        }
+
+        swap_pixel_bytes(out_slots[s], (size_t)n * N);
+        MPI_File_iwrite_at(out_file, out_offset + (MPI_Offset)x0 * N * sizeof(pixel), out_slots[s],
+                           n * N, MPI_PIXEL, &writes[s]);
+    }
+
+    MPI_Waitall(2, writes, MPI_STATUSES_IGNORE);
+
+    for (int s = 0; s < 2; s++) {
+        free(in_slots[s]);
+        free(out_slots[s]);
+    }
+}
+
+/**
+ * Filter image rows [x0, x0 + n) into out (n x N), across the rank's
+ * threads. in holds image rows from in_first_row on, including the
+ * `radius` rows around the band that exist. The outer `radius` rows and
+ * columns of the image are copied unchanged, as in mask_operation().
+ */
+void stream_band(const pixel* const in, const int in_first_row, pixel* const out, const int x0, const int n,
+                 const int M, const int N, const struct stencil_kernel* const kernel) {
+    const int H = kernel->radius;
+
+    // Rows with a full neighbourhood.
+    const int f0 = (x0 > H) ? x0 : H;
+    const int f1 = (x0 + n < M - H) ? x0 + n : M - H; // exclusive
+
+    #pragma omp parallel
+    {
+        int first, count;
+        split_rows(n, omp_get_num_threads(), omp_get_thread_num(), &first, &count);
+
+        for (int x = x0 + first; x < x0 + first + count; x++) {
+            const pixel* const row_in = &in[(size_t)(x - in_first_row) * N];
+            pixel* const row_out = &out[(size_t)(x - x0) * N];
+
+            if (x < f0 || x >= f1 || N <= 2 * H) {
+                memcpy(row_out, row_in, N * sizeof(pixel));
+            }
+            else {
+                memcpy(row_out, row_in, H * sizeof(pixel));
+                memcpy(&row_out[N - H], &row_in[N - H], H * sizeof(pixel));
+            }
+        }
+
+        const int lo = (x0 + first > f0) ? x0 + first : f0;
+        const int hi = (x0 + first + count < f1) ? x0 + first + count : f1;
+        if (lo < hi && N > 2 * H) {
+            stencil_apply(kernel, hi - lo, N - 2 * H, &in[(size_t)(lo - in_first_row) * N + H], N,
+                          &out[(size_t)(lo - x0) * N + H], N);
+        }
+    }
+}
+
+//------------------------------
+// Performance profiling
+//------------------------------
+double tdiff(const struct timespec start, const struct timespec stop) {
+    return ( stop.tv_sec - start.tv_sec ) + ( stop.tv_nsec - start.tv_nsec ) / 1E9;
 }
 
 struct timespec now(void) {
@@ -445,4 +2225,3 @@ struct timespec now(void) {
     clock_gettime(CLOCK_REALTIME, &t);
     return t;
 }
-
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include "gemm.h"
 
 /*   ttype: type to use for representing time */
 typedef double ttype;
@@ -43,10 +44,10 @@ int	numtasks,            /* number of tasks in partition */
 	mtype,                 /* message type */
 	rows,                  /* rows of matrix A sent to each worker */
 	averow, extra, offset, /* used to determine rows sent to each worker */
-	i, j, k, rc;           /* misc */
-int	A[NRA][NCA],         /* matrix A to be multiplied */
- 	B[NRB][NCB],           /* matrix B to be multiplied */
-	C[NRA][NCB];           /* result matrix C */
+	i, j, rc = 1;          /* misc */
+gemm_elem A[NRA][NCA],       /* matrix A to be multiplied */
+ 	B[NRB][NCB];           /* matrix B to be multiplied */
+gemm_acc C[NRA][NCB];        /* result matrix C */
 MPI_Status status;
 
 //clock_t begin, end;
@@ -88,7 +89,7 @@ numworkers = numtasks-1;
       printf (" Contents of matrix A\n");
       for (i=0; i<NRA; i++) {  
         for (j=0; j<NCA; j++)
-        printf("%d\t", A[i][j]);
+        printf("%" GEMM_ELEM_FMT "\t", A[i][j]);
         printf("\n");
       }     
             
@@ -99,7 +100,7 @@ numworkers = numtasks-1;
       printf (" Contents of matrix B\n");
       for (i=0; i<NRB; i++) {  
         for (j=0; j<NCB; j++)
-        printf("%d\t", B[i][j]);
+        printf("%" GEMM_ELEM_FMT "\t", B[i][j]);
         printf("\n");
         printf("\n");        
       }     
@@ -120,9 +121,9 @@ numworkers = numtasks-1;
          printf("Sending %d rows to task %d offset=%d\n",rows,dest,offset);
          MPI_Send(&offset, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
          MPI_Send(&rows, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
-         MPI_Send(&A[offset][0], rows*NCA, MPI_INT, dest, mtype,
+         MPI_Send(&A[offset][0], rows*NCA, MPI_GEMM_ELEM, dest, mtype,
                    MPI_COMM_WORLD);
-         MPI_Send(&B, NRB*NCB, MPI_INT, dest, mtype, MPI_COMM_WORLD);         
+         MPI_Send(&B, NRB*NCB, MPI_GEMM_ELEM, dest, mtype, MPI_COMM_WORLD);         
          offset = offset + rows;
       }
 
@@ -133,7 +134,7 @@ numworkers = numtasks-1;
          source = i;
          MPI_Recv(&offset, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
          MPI_Recv(&rows, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
-         MPI_Recv(&C[offset][0], rows*NCB, MPI_INT, source, mtype, 
+         MPI_Recv(&C[offset][0], rows*NCB, MPI_GEMM_ACC, source, mtype, 
                   MPI_COMM_WORLD, &status);
          printf("Received results from task %d\n",source);
       }
@@ -150,7 +151,7 @@ numworkers = numtasks-1;
       {
          printf("\n"); 
          for (j=0; j<NCB; j++) 
-            printf("%d\t", C[i][j]);
+            printf("%" GEMM_ACC_FMT "\t", C[i][j]);
       }
       
       printf("\n******************************************************\n");
@@ -166,21 +167,15 @@ numworkers = numtasks-1;
       mtype = FROM_MASTER;
       MPI_Recv(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
       MPI_Recv(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-      MPI_Recv(&A, rows*NCA, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-      MPI_Recv(&B, NRB*NCB, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
+      MPI_Recv(&A, rows*NCA, MPI_GEMM_ELEM, MASTER, mtype, MPI_COMM_WORLD, &status);
+      MPI_Recv(&B, NRB*NCB, MPI_GEMM_ELEM, MASTER, mtype, MPI_COMM_WORLD, &status);
             
-      for (i=0; i<rows; i++)
-         for (j=0; j<NCB; j++)
-         {
-           C[i][j] = 0;
-           for (k=0; k<NCA; k++)            
-              C[i][j] = C[i][j] + A[i][k] * B[k][j];
-         }
+      gemm(rows, NCB, NCA, &A[0][0], NCA, &B[0][0], NCB, &C[0][0], NCB);
          
       mtype = FROM_WORKER;
       MPI_Send(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
       MPI_Send(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
-      MPI_Send(&C, rows*NCB, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
+      MPI_Send(&C, rows*NCB, MPI_GEMM_ACC, MASTER, mtype, MPI_COMM_WORLD);
    }
    MPI_Finalize();
 }
@@ -8,7 +8,9 @@
 #SBATCH -t 00:00:20
 #SBATCH -o out.txt
 #SBATCH -e err.txt
-export OMP_NUM_THREADS=8
+# One thread per CPU slurm gave the task; more would time-share cores.
+export OMP_NUM_THREADS=${SLURM_CPUS_PER_TASK:-4}
 #(NRA, NCA_RB, NCB)
-srun ./matmult_hybrid 60 12 10
+# Each task gets its own cores; matmult_hybrid pins its threads within them.
+srun --cpu-bind=cores ./matmult_hybrid 60 12 10
 
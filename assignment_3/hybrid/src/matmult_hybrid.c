@@ -1,9 +1,12 @@
+#define _GNU_SOURCE            /* sched_getaffinity(), sched_getcpu() and the CPU_* macros */
 #include "mpi.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <sched.h>
 #include <omp.h>
+#include "gemm.h"
 
 /*   ttype: type to use for representing time */
 typedef double ttype;
@@ -24,13 +27,243 @@ struct timespec now(void)
 
 
 
-#define NRA 60                 /* number of rows in matrix A */
-#define NCA 12                 /* number of columns in matrix A */
-#define NRB 12                 /* number of rows in matrix B, should equal to NCA */
-#define NCB 10                  /* number of columns in matrix B */
 #define MASTER 0               /* taskid of first task */
 #define FROM_MASTER 1          /* setting a message type */
 #define FROM_WORKER 2          /* setting a message type */
+#define MATRIX_ALIGN 64        /* byte alignment of matrix buffers (one cache line) */
+#define PRINT_MAX 200          /* only print matrices with at most this many rows and cols */
+#define MAP_MAX_THREADS 256    /* threads per rank shown in the thread map */
+
+/**
+ * Allocate a contiguous, cache-line aligned rows x cols matrix of
+ * `size`-byte elements.
+ * Index the result through a `gemm_elem (*)[cols]` (or gemm_acc) pointer.
+ */
+void* alloc_matrix(const int rows, const int cols, const size_t size, const char* const name)
+{
+    size_t bytes = (size_t)rows * cols * size;
+    // aligned_alloc wants a multiple of the alignment.
+    bytes = (bytes + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+
+    void* const matrix = aligned_alloc(MATRIX_ALIGN, bytes ? bytes : MATRIX_ALIGN);
+    if (matrix == NULL) {
+        printf("ERROR: Couldn't allocate %s (%d x %d).\n", name, rows, cols);
+        fflush(stdout);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return matrix;
+}
+
+//////////////////////////////
+// Thread affinity
+//////////////////////////////
+/**
+ * The socket (package) and core a CPU (hardware thread) belongs to, from
+ * sysfs. Without topology info every CPU counts as its own core.
+ */
+void cpu_topology(const int cpu, int* const package, int* const core)
+{
+    const char* const files[2] = {"physical_package_id", "core_id"};
+    int ids[2];
+    for (int i = 0; i < 2; i++) {
+        char path[128];
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, files[i]);
+        FILE* const file = fopen(path, "r");
+        const int found = file != NULL && fscanf(file, "%d", &ids[i]) == 1;
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (!found) {
+            *package = 0;
+            *core = cpu;
+            return;
+        }
+    }
+    *package = ids[0];
+    *core = ids[1];
+}
+
+/**
+ * The CPUs this rank's threads should run on: one per core first, then
+ * the cores' other hardware threads, so threads get distinct cores while
+ * there are enough of them.
+ * Ranks on the node that got the same cpuset (all of them when launched
+ * without any binding, or those of one socket with --bind-to socket)
+ * each take their own slice of its cores instead of all piling onto the
+ * first few. With more of them than cores, they're dealt the cores round
+ * robin and have to share.
+ * cpus: room for CPU_SETSIZE. Returns how many were filled in; *cores is
+ * the number of distinct cores among them and *sharers how many ranks
+ * (this one included) run on them.
+ */
+int rank_cpus(int* const cpus, int* const cores, int* const sharers)
+{
+    cpu_set_t mine;
+    CPU_ZERO(&mine);
+    sched_getaffinity(0, sizeof mine, &mine);
+
+    // This rank's place among the ranks on the node with the same cpuset.
+    MPI_Comm node;
+    int local_rank, local_size;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &local_rank);
+    MPI_Comm_size(node, &local_size);
+    cpu_set_t* const masks = malloc(local_size * sizeof mine);
+    MPI_Allgather(&mine, sizeof mine, MPI_UNSIGNED_CHAR, masks, sizeof mine, MPI_UNSIGNED_CHAR, node);
+    MPI_Comm_free(&node);
+
+    int group_rank = 0, group_size = 0;
+    for (int r = 0; r < local_size; r++) {
+        if (CPU_EQUAL(&masks[r], &mine)) {
+            group_rank += r < local_rank;
+            group_size++;
+        }
+    }
+    free(masks);
+
+    // Allowed CPUs with their core (package and core id in one number),
+    // and the distinct cores in order of first appearance.
+    int* const cpu_list = malloc(3 * CPU_SETSIZE * sizeof(int));
+    int* const cpu_core = &cpu_list[CPU_SETSIZE];
+    int* const core_list = &cpu_list[2 * CPU_SETSIZE];
+    int num_cpus = 0, num_cores = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &mine)) {
+            continue;
+        }
+        int package, core;
+        cpu_topology(cpu, &package, &core);
+        cpu_list[num_cpus] = cpu;
+        cpu_core[num_cpus] = package * CPU_SETSIZE + core;
+
+        int k = 0;
+        while (k < num_cores && core_list[k] != cpu_core[num_cpus]) {
+            k++;
+        }
+        if (k == num_cores) {
+            core_list[num_cores++] = cpu_core[num_cpus];
+        }
+        num_cpus++;
+    }
+
+    // This rank's slice of the cores; with more ranks than cores, one each.
+    int first = 0, last = num_cores;
+    *sharers = 1;
+    if (group_size > num_cores) {
+        first = group_rank % num_cores;
+        last = first + 1;
+        *sharers = (group_size - 1 - first) / num_cores + 1;
+    }
+    else if (group_size > 1) {
+        first = (int)((long long)num_cores * group_rank / group_size);
+        last = (int)((long long)num_cores * (group_rank + 1) / group_size);
+    }
+
+    // Round r takes the r-th hardware thread of every core in the slice.
+    int n = 0;
+    for (int round = 0, added = 1; added; round++) {
+        added = 0;
+        for (int k = first; k < last; k++) {
+            int seen = 0;
+            for (int i = 0; i < num_cpus; i++) {
+                if (cpu_core[i] == core_list[k] && seen++ == round) {
+                    cpus[n++] = cpu_list[i];
+                    added = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(cpu_list);
+    *cores = last - first;
+    return n;
+}
+
+/**
+ * Pin each OpenMP thread of this rank to its own CPU from rank_cpus(),
+ * unless OMP_PROC_BIND is set, in which case the runtime's binding is
+ * left alone. Warns when the threads outnumber the cores or the rank has
+ * to share its cores with other ranks.
+ */
+void pin_threads(const int taskid)
+{
+    int* const cpus = malloc(CPU_SETSIZE * sizeof(int));
+    int cores, sharers;
+    const int num_cpus = rank_cpus(cpus, &cores, &sharers);
+    const int nthreads = omp_get_max_threads();
+
+    if (sharers > 1) {
+        printf("WARNING: %d ranks share rank %d's core, so their threads time-share. "
+               "Start fewer ranks per node.\n", sharers, taskid);
+    }
+    if (nthreads > num_cpus) {
+        printf("WARNING: Rank %d runs %d threads on %d CPUs, so they time-share. "
+               "Match OMP_NUM_THREADS to the CPUs per task.\n", taskid, nthreads, num_cpus);
+    }
+    else if (nthreads > cores) {
+        printf("WARNING: Rank %d runs %d threads on %d cores, so some share a core.\n", taskid, nthreads, cores);
+    }
+
+    if (omp_get_proc_bind() == omp_proc_bind_false) {
+        #pragma omp parallel
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[omp_get_thread_num() % num_cpus], &set);
+            sched_setaffinity(0, sizeof set, &set);
+        }
+    }
+    free(cpus);
+}
+
+/**
+ * Print, on the master, which CPU every thread of every rank runs on, and
+ * that CPU's socket and core.
+ */
+void print_thread_map(const int taskid, const int numtasks)
+{
+    // Thread count, then (cpu, socket, core) per thread.
+    const int stride = 1 + 3 * MAP_MAX_THREADS;
+    int map[1 + 3 * MAP_MAX_THREADS];
+    char host[MPI_MAX_PROCESSOR_NAME] = {0};
+    int len;
+    MPI_Get_processor_name(host, &len);
+
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        if (tid == 0) {
+            map[0] = GEMM_MIN(omp_get_num_threads(), MAP_MAX_THREADS);
+        }
+        if (tid < MAP_MAX_THREADS) {
+            int* const entry = &map[1 + 3 * tid];
+            entry[0] = sched_getcpu();
+            cpu_topology(entry[0], &entry[1], &entry[2]);
+        }
+    }
+
+    int* const maps = (taskid == MASTER) ? malloc((size_t)numtasks * stride * sizeof(int)) : NULL;
+    char* const hosts = (taskid == MASTER) ? malloc((size_t)numtasks * MPI_MAX_PROCESSOR_NAME) : NULL;
+    MPI_Gather(map, stride, MPI_INT, maps, stride, MPI_INT, MASTER, MPI_COMM_WORLD);
+    MPI_Gather(host, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, hosts, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, MASTER, MPI_COMM_WORLD);
+
+    if (taskid == MASTER) {
+        printf("Thread map (thread->cpu(socket.core)):\n");
+        for (int r = 0; r < numtasks; r++) {
+            const int* const rank_map = &maps[r * stride];
+            printf("  rank %d on %s:", r, &hosts[r * MPI_MAX_PROCESSOR_NAME]);
+            for (int t = 0; t < rank_map[0]; t++) {
+                const int* const entry = &rank_map[1 + 3 * t];
+                printf(" %d->%d(%d.%d)", t, entry[0], entry[1], entry[2]);
+            }
+            printf("\n");
+        }
+        printf("\n");
+        free(maps);
+        free(hosts);
+    }
+}
 
 int main (int argc, char *argv[])
 {
@@ -42,10 +275,7 @@ int main (int argc, char *argv[])
     mtype,                 /* message type */
     rows,                  /* rows of matrix A sent to each worker */
     averow, extra, offset, /* used to determine rows sent to each worker */
-    i, j, k, rc;           /* misc */
-    int	A[NRA][NCA],         /* matrix A to be multiplied */
-    B[NRB][NCB],           /* matrix B to be multiplied */
-    C[NRA][NCB];           /* result matrix C */
+    i, j, rc = 1;          /* misc */
     MPI_Status status;
 
     //clock_t begin, end;
@@ -64,19 +294,45 @@ int main (int argc, char *argv[])
     }
     numworkers = numtasks-1;
 
+    if (argc != 3 + 1) {
+        if (taskid == MASTER) {
+            printf("Usage: ./matmult_hybrid <rows in A> <cols in A/rows in B> <cols in B>\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Every rank gets the same command line, so no need to send these.
+    const int NRA = atof(argv[1]);   /* number of rows in matrix A */
+    const int NCA = atof(argv[2]);   /* number of columns in matrix A */
+    const int NRB = NCA;             /* number of rows in matrix B */
+    const int NCB = atof(argv[3]);   /* number of columns in matrix B */
+
+    if (NRA <= 0 || NCA <= 0 || NCB <= 0) {
+        if (taskid == MASTER) {
+            printf("Matrix dimensions must be positive.\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Keep each rank's threads on their own cores before any work starts.
+    pin_threads(taskid);
+    print_thread_map(taskid, numtasks);
+
     /**************************** master task ************************************/
     if (taskid == MASTER)
     {
 
-        // Do some basic error checking
-        if (NRB != NCA) {
-            printf ("Matrix a column size must equal matrix b row size.\n");
-            return 1;
-        } 
+        // The master holds the full matrices.
+        gemm_elem (* const A)[NCA] = alloc_matrix(NRA, NCA, sizeof(gemm_elem), "A");
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_acc (* const C)[NCB] = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C");
 
         printf("mpi_mm has started with %d tasks.\n",numtasks);
         printf("Matrix A: #rows %d; #cols %d\n", NRA, NCA);
         printf("Matrix B: #rows %d; #cols %d\n", NRB, NCB);
+        printf("Elements: %s (%s kernel)\n", GEMM_TYPE_NAME, GEMM_ISA);
         printf ("\n");
 
         printf("Initializing arrays...\n");
@@ -85,25 +341,29 @@ int main (int argc, char *argv[])
                 for (j=0; j<NCA; j++)
                     A[i][j]= i+j;  
 
-        printf (" Contents of matrix A\n");
-        for (i=0; i<NRA; i++) {  
-            for (j=0; j<NCA; j++)
-                printf("%d\t", A[i][j]);
-            printf("\n");
-        }     
+        if (NRA <= PRINT_MAX && NCA <= PRINT_MAX) {
+            printf (" Contents of matrix A\n");
+            for (i=0; i<NRA; i++) {  
+                for (j=0; j<NCA; j++)
+                    printf("%" GEMM_ELEM_FMT "\t", A[i][j]);
+                printf("\n");
+            }     
+        }
 
         #pragma omp parallel for shared(B) private(i, j) 
             for (i=0; i<NRB; i++)   
                 for (j=0; j<NCB; j++)
                     B[i][j]= i-j;
 
-        printf (" Contents of matrix B\n");
-        for (i=0; i<NRB; i++) {  
-            for (j=0; j<NCB; j++)
-                printf("%d\t", B[i][j]);
-            printf("\n");
-            printf("\n");        
-        }     
+        if (NRB <= PRINT_MAX && NCB <= PRINT_MAX) {
+            printf (" Contents of matrix B\n");
+            for (i=0; i<NRB; i++) {  
+                for (j=0; j<NCB; j++)
+                    printf("%" GEMM_ELEM_FMT "\t", B[i][j]);
+                printf("\n");
+                printf("\n");        
+            }     
+        }
 
 
         /* Send matrix data to the worker tasks */
@@ -121,9 +381,9 @@ int main (int argc, char *argv[])
             printf("Sending %d rows to task %d offset=%d\n",rows,dest,offset);
             MPI_Send(&offset, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
             MPI_Send(&rows, 1, MPI_INT, dest, mtype, MPI_COMM_WORLD);
-            MPI_Send(&A[offset][0], rows*NCA, MPI_INT, dest, mtype,
+            MPI_Send(&A[offset][0], rows*NCA, MPI_GEMM_ELEM, dest, mtype,
                      MPI_COMM_WORLD);
-            MPI_Send(&B, NRB*NCB, MPI_INT, dest, mtype, MPI_COMM_WORLD);         
+            MPI_Send(&B[0][0], NRB*NCB, MPI_GEMM_ELEM, dest, mtype, MPI_COMM_WORLD);         
             offset = offset + rows;
         }
 
@@ -134,7 +394,7 @@ int main (int argc, char *argv[])
             source = i;
             MPI_Recv(&offset, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
             MPI_Recv(&rows, 1, MPI_INT, source, mtype, MPI_COMM_WORLD, &status);
-            MPI_Recv(&C[offset][0], rows*NCB, MPI_INT, source, mtype, 
+            MPI_Recv(&C[offset][0], rows*NCB, MPI_GEMM_ACC, source, mtype, 
                      MPI_COMM_WORLD, &status);
             printf("Received results from task %d\n",source);
         }
@@ -144,20 +404,26 @@ int main (int argc, char *argv[])
         time_spent = tdiff(begin, end);
 
         /* Print results */
-        printf ("\n");
-        printf("******************************************************\n");
-        printf("Result Matrix:\n");
-        for (i=0; i<NRA; i++)
-        {
-            printf("\n"); 
-            for (j=0; j<NCB; j++) 
-                printf("%d\t", C[i][j]);
-        }
+        if (NRA <= PRINT_MAX && NCB <= PRINT_MAX) {
+            printf ("\n");
+            printf("******************************************************\n");
+            printf("Result Matrix:\n");
+            for (i=0; i<NRA; i++)
+            {
+                printf("\n"); 
+                for (j=0; j<NCB; j++) 
+                    printf("%" GEMM_ACC_FMT "\t", C[i][j]);
+            }
 
-        printf("\n******************************************************\n");
+            printf("\n******************************************************\n");
+        }
         printf ("\n");
         printf("total time: %.8f sec\n", time_spent);
         printf ("\n");
+
+        free(A);
+        free(B);
+        free(C);
     }
 
 
@@ -167,22 +433,34 @@ int main (int argc, char *argv[])
         mtype = FROM_MASTER;
         MPI_Recv(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
         MPI_Recv(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-        MPI_Recv(&A, rows*NCA, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
-        MPI_Recv(&B, NRB*NCB, MPI_INT, MASTER, mtype, MPI_COMM_WORLD, &status);
 
-        #pragma omp parallel for shared(A, B, C) private(i, j)
-        for (i=0; i<rows; i++)
-            for (j=0; j<NCB; j++)
-            {
-                C[i][j] = 0;
-                for (k=0; k<NCA; k++)            
-                    C[i][j] = C[i][j] + A[i][k] * B[k][j];
-            }
+        // Workers only hold their own slab of A and C (plus all of B).
+        gemm_elem (* const A)[NCA] = alloc_matrix(rows, NCA, sizeof(gemm_elem), "A slab");
+        gemm_elem (* const B)[NCB] = alloc_matrix(NRB, NCB, sizeof(gemm_elem), "B");
+        gemm_acc (* const C)[NCB] = alloc_matrix(rows, NCB, sizeof(gemm_acc), "C slab");
+
+        MPI_Recv(&A[0][0], rows*NCA, MPI_GEMM_ELEM, MASTER, mtype, MPI_COMM_WORLD, &status);
+        MPI_Recv(&B[0][0], NRB*NCB, MPI_GEMM_ELEM, MASTER, mtype, MPI_COMM_WORLD, &status);
+
+        // Each thread multiplies a contiguous band of this worker's rows.
+        #pragma omp parallel shared(A, B, C)
+        {
+            const int nthreads = omp_get_num_threads();
+            const int tid = omp_get_thread_num();
+            const int first = rows * tid / nthreads;
+            const int last = rows * (tid + 1) / nthreads;
+
+            gemm(last - first, NCB, NCA, &A[first][0], NCA, &B[0][0], NCB, &C[first][0], NCB);
+        }
 
         mtype = FROM_WORKER;
         MPI_Send(&offset, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
         MPI_Send(&rows, 1, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
-        MPI_Send(&C, rows*NCB, MPI_INT, MASTER, mtype, MPI_COMM_WORLD);
+        MPI_Send(&C[0][0], rows*NCB, MPI_GEMM_ACC, MASTER, mtype, MPI_COMM_WORLD);
+
+        free(A);
+        free(B);
+        free(C);
     }
     MPI_Finalize();
 }
@@ -9,7 +9,10 @@
 #SBATCH -o out_200x200_8.txt
 #SBATCH -e err.txt
 export OMP_NUM_THREADS=8
-#(NRA, NCA_RB, NCB)
+# Pin the threads, so the pages they first-touch stay on their node.
+export OMP_PLACES=cores
+export OMP_PROC_BIND=spread
+#(NRA, NCA_RB, NCB, [placement: first-touch | interleave | bind], [mode: rows | recursive | strassen])
 #(./matmult 60 12 10)
 ./matmult 200 200 200
 
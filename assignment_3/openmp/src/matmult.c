@@ -1,10 +1,51 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <omp.h>
+#include "gemm.h"
 
 #define DEBUG
 
+#define PRINT_MAX 200          /* only print matrices with at most this many rows and cols */
+
+// Where the pages of A, B and C end up on a NUMA machine. Whichever
+// thread writes a page first gets it from its own node's memory.
+enum placement {
+    PLACE_FIRST_TOUCH, // each thread initializes the rows it multiplies (thread_rows())
+    PLACE_INTERLEAVE,  // pages are dealt to the threads round robin, so every node holds a share
+    PLACE_BIND,        // first touch, but only with threads pinned to places (OMP_PROC_BIND)
+    NUM_PLACEMENTS
+};
+const char* const placement_names[NUM_PLACEMENTS] = {"first-touch", "interleave", "bind"};
+
+// How the multiply is shared among the threads.
+enum mode {
+    MODE_ROWS,      // a static band of rows per thread (thread_rows())
+    MODE_RECURSIVE, // cache-oblivious halving into OpenMP tasks (recursive_gemm())
+    MODE_STRASSEN,  // Strassen-Winograd over the blocked kernel, products as OpenMP tasks (strassen())
+    NUM_MODES
+};
+const char* const mode_names[NUM_MODES] = {"rows", "recursive", "strassen"};
+
+// Recursive mode stops splitting at this many multiply-adds (M * N * K)
+// and hands the piece to the blocked kernel, or sooner if that would leave
+// fewer than RECURSE_PIECES pieces per thread. Pieces much smaller than
+// this spend their time packing.
+#ifndef RECURSE_CUTOFF
+#define RECURSE_CUTOFF (128 * 128 * 128)
+#endif
+#ifndef RECURSE_PIECES
+#define RECURSE_PIECES 4
+#endif
+
+// Strassen mode only splits while M, N and K are all at least this big;
+// below it the classical blocked kernel is faster.
+#ifndef STRASSEN_CROSSOVER
+#define STRASSEN_CROSSOVER 1024
+#endif
+
 //////////////////////////////
 // Useful debugging macros
 //////////////////////////////
@@ -41,36 +82,358 @@ struct timespec now() {
 //////////////////////////////
 // Helper functions
 //////////////////////////////
+size_t page_size(void) {
+    const long bytes = sysconf(_SC_PAGESIZE);
+    return (bytes > 0) ? (size_t)bytes : 4096;
+}
+
+/**
+ * Allocate n page-aligned elements of `size` bytes, without touching them.
+ */
+void* alloc_array(const size_t n, const size_t size, const char* const name) {
+    const size_t page = page_size();
+    size_t bytes = n * size;
+    // aligned_alloc wants a multiple of the alignment.
+    bytes = (bytes + page - 1) / page * page;
+
+    void* const array = aligned_alloc(page, bytes ? bytes : page);
+    if (array == NULL) {
+        printf("ERROR: Couldn't allocate %s (%zu elements).\n", name, n);
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+/**
+ * Allocate a contiguous, page-aligned rows x cols matrix of `size`-byte
+ * elements, without touching it (see init_matrix_elem()).
+ * Index the result through a `gemm_elem (*)[cols]` (or gemm_acc) pointer.
+ */
+void* alloc_matrix(const int rows, const int cols, const size_t size, const char* const name) {
+    return alloc_array((size_t)rows * cols, size, name);
+}
+
+/**
+ * The band of rows [first, last) that thread tid of nthreads multiplies:
+ * the same static split as `omp for`.
+ */
+void thread_rows(const int rows, const int tid, const int nthreads, int* const first, int* const last) {
+    *first = (int)((long long)rows * tid / nthreads);
+    *last = (int)((long long)rows * (tid + 1) / nthreads);
+}
+
+int matrix_value(const int r, const int c, const char plus_or_minus) {
+    if(plus_or_minus == '+') {
+        return r + c;
+    }
+    else if(plus_or_minus == '-') {
+        return r - c;
+    }
+    return 0;
+}
+
+// The helpers that walk a whole matrix come in two copies: _elem for A and
+// B, _acc for C. They're the same type unless GEMM_WIDEN.
+//
+// __print_matrix: only prints matrices up to PRINT_MAX in each direction.
+//
+// init_matrix: fill A with r + c ('+'), r - c ('-') or zeros (anything
+// else), in parallel, so the pages land where `placement` wants them.
+// First touch gives each thread the rows thread_rows() gives it in the
+// multiply. For B, which every thread reads whole, that just spreads it
+// over the nodes in bands.
+#define MATRIX_HELPERS(suffix, T, FMT) \
+void __print_matrix_##suffix(const int M, const int N, const char* const name, const T (* const matrix)[N]) { \
+    if (M > PRINT_MAX || N > PRINT_MAX) { \
+        return; \
+    } \
+ \
+    printf("=============== Matrix %s ===============\n", name); \
+    for(int r = 0; r < M; r++) { \
+        for(int c = 0; c < N; c++) { \
+            printf("%3" FMT " ", matrix[r][c]); \
+        } \
+        printf("\n"); \
+    } \
+    printf("=============== End of %s ===============\n", name); \
+} \
+ \
+void init_matrix_##suffix(const int rows, const int cols, T A[rows][cols], char plus_or_minus, \
+                          const enum placement placement) { \
+    const size_t per_page = page_size() / sizeof(T); \
+    const size_t total = (size_t)rows * cols; \
+ \
+    _Pragma("omp parallel") \
+    { \
+        const int tid = omp_get_thread_num(); \
+        const int nthreads = omp_get_num_threads(); \
+ \
+        if (placement == PLACE_INTERLEAVE) { \
+            T* const flat = &A[0][0]; \
+            for (size_t start = tid * per_page; start < total; start += nthreads * per_page) { \
+                const size_t end = (start + per_page < total) ? start + per_page : total; \
+                for (size_t i = start; i < end; i++) { \
+                    flat[i] = matrix_value(i / cols, i % cols, plus_or_minus); \
+                } \
+            } \
+        } \
+        else { \
+            int first, last; \
+            thread_rows(rows, tid, nthreads, &first, &last); \
+            for(int r = first; r < last; r++) { \
+                for(int c = 0; c < cols; c++) { \
+                    A[r][c] = matrix_value(r, c, plus_or_minus); \
+                } \
+            } \
+        } \
+    } \
+}
+MATRIX_HELPERS(elem, gemm_elem, GEMM_ELEM_FMT)
+MATRIX_HELPERS(acc, gemm_acc, GEMM_ACC_FMT)
+
 // Prints the name of the variable alongside the matrix itself!
-#define print_matrix(M, N, A) (__print_matrix(M, N, #A, A))
-void __print_matrix(const int M, const int N, const char* const name, const int (* const matrix)[N]) {
-    printf("=============== Matrix %s ===============\n", name);
-    for(int r = 0; r < M; r++) {
-        for(int c = 0; c < N; c++) {
-            printf("%3d ", matrix[r][c]);
-        }
-        printf("\n");
+#define print_matrix(M, N, A) (__print_matrix_elem(M, N, #A, A))
+#define print_result(M, N, C) (__print_matrix_acc(M, N, #C, C))
+
+/**
+ * Where to halve n: on a multiple of `quantum` (the kernel's tile) when
+ * there's room for one on each side.
+ */
+int split_point(const int n, const int quantum) {
+    if (n < 2 * quantum) {
+        return n / 2;
     }
-    printf("=============== End of %s ===============\n", name);
+    return n / 2 / quantum * quantum;
 }
 
+/**
+ * C += A * B, cache-oblivious: halve the largest of M, N and K until the
+ * piece is at most `cutoff` multiply-adds, then call the blocked kernel.
+ * Halves of M or N write disjoint parts of C, so they become tasks and
+ * any idle thread can take one. Halves of K add into the same C, so they
+ * run one after the other. Whatever the shape, the pieces end up roughly
+ * cubic (good reuse in cache) and many more than the threads (good
+ * balance).
+ * Call from inside a parallel region, on one thread (omp single).
+ */
+void recursive_gemm(const int M, const int N, const int K,
+                    const gemm_elem* const A, const int lda,
+                    const gemm_elem* const B, const int ldb,
+                    gemm_acc* const C, const int ldc, const long long cutoff) {
+    // A 1x1x1 piece can't be halved, whatever the cutoff.
+    if ((long long)M * N * K <= cutoff || (M <= 1 && N <= 1 && K <= 1)) {
+        gemm_accumulate(M, N, K, A, lda, B, ldb, C, ldc);
+        return;
+    }
+
+    if (M >= N && M >= K) {
+        const int m = split_point(M, GEMM_MR);
+        #pragma omp task
+        recursive_gemm(m, N, K, A, lda, B, ldb, C, ldc, cutoff);
+        #pragma omp task
+        recursive_gemm(M - m, N, K, &A[m * lda], lda, B, ldb, &C[m * ldc], ldc, cutoff);
+        #pragma omp taskwait
+    }
+    else if (N >= K) {
+        const int n = split_point(N, GEMM_NR);
+        #pragma omp task
+        recursive_gemm(M, n, K, A, lda, B, ldb, C, ldc, cutoff);
+        #pragma omp task
+        recursive_gemm(M, N - n, K, A, lda, &B[n], ldb, &C[n], ldc, cutoff);
+        #pragma omp taskwait
+    }
+    else {
+        const int k = split_point(K, GEMM_KC);
+        recursive_gemm(M, N, k, A, lda, B, ldb, C, ldc, cutoff);
+        recursive_gemm(M, N, K - k, &A[k], lda, &B[k * ldb], ldb, C, ldc, cutoff);
+    }
+}
 
-void init_matrix(const int rows, const int cols, int A[rows][cols], char plus_or_minus) {
-    for(int r = 0; r < rows; r++) {
-        for(int c = 0; c < cols; c++) {
-            int temp;
+#if !GEMM_WIDEN
+// Strassen adds and subtracts A and B, so its sums have to fit in their
+// type: it's left out when only C is widened.
 
-            if(plus_or_minus == '+') {
-                temp = r + c;
+// Integers wrap through unsigned, where it's defined, like the kernel's
+// vector arithmetic does.
+#if GEMM_IS_FLOAT
+#define ADD_WRAP(x, y) ((x) + (y))
+#define SUB_WRAP(x, y) ((x) - (y))
+#else
+#define ADD_WRAP(x, y) ((gemm_acc)((uint64_t)(x) + (uint64_t)(y)))
+#define SUB_WRAP(x, y) ((gemm_acc)((uint64_t)(x) - (uint64_t)(y)))
+#endif
+
+/**
+ * Z = X + Y (sign > 0) or X - Y, all m x n. Integers wrap on overflow
+ * (ADD_WRAP()), so Strassen's sums give the same C as the classical
+ * product.
+ */
+void mat_add(const int m, const int n, const gemm_acc* const X, const int ldx, const gemm_acc* const Y, const int ldy,
+             gemm_acc* const Z, const int ldz, const int sign) {
+    for (int r = 0; r < m; r++) {
+        const gemm_acc* const x = &X[r * ldx];
+        const gemm_acc* const y = &Y[r * ldy];
+        gemm_acc* const z = &Z[r * ldz];
+        if (sign > 0) {
+            for (int c = 0; c < n; c++) {
+                z[c] = ADD_WRAP(x[c], y[c]);
             }
+        }
         else {
-                temp = r - c;
+            for (int c = 0; c < n; c++) {
+                z[c] = SUB_WRAP(x[c], y[c]);
             }
+        }
+    }
+}
 
-            A[r][c] = temp;
+/**
+ * Scratch elements strassen() needs for an MxK by KxN product, including every
+ * level below: each of the top `task_levels` levels gives its 7 products
+ * one arena each, the sequential levels below share one. Each arena ends
+ * in the kernel's packing buffer for its leaf, and the odd row, col and k
+ * a level peels off pack into its products' arenas once they're done, so
+ * every task packs into a buffer of its own without allocating one.
+ * Arenas are whole cache lines, so the packing buffers stay aligned.
+ */
+size_t strassen_scratch(const int M, const int N, const int K, const int task_levels) {
+    if (M < STRASSEN_CROSSOVER || N < STRASSEN_CROSSOVER || K < STRASSEN_CROSSOVER) {
+        return gemm_pack_size(M, N, K);
+    }
+
+    const size_t m = M / 2, n = N / 2, k = K / 2;
+    const size_t own = GEMM_ROUND_UP(4 * m * k + 4 * k * n + 3 * m * n, GEMM_ALIGN / sizeof(gemm_acc));
+    const size_t child = strassen_scratch(m, n, k, (task_levels > 0) ? task_levels - 1 : 0);
+    const size_t children = ((task_levels > 0) ? 7 : 1) * child;
+    const size_t peel = gemm_pack_size(M, N, K);
+    return own + ((children > peel) ? children : peel);
+}
+
+/**
+ * C = A * B by Strassen-Winograd: 7 half-size products and 15 additions
+ * per level instead of 8 products, down to STRASSEN_CROSSOVER, where the
+ * blocked kernel takes over.
+ *
+ * With m, n, k half of M, N, K (rounded down), one level is
+ *   S1 = A21 + A22   T1 = B12 - B11   M1 = A11 B11   M5 = S1 T1
+ *   S2 = S1 - A11    T2 = B22 - T1    M2 = A12 B21   M6 = S2 T2
+ *   S3 = A11 - A21   T3 = B22 - B12   M3 = S4 B22    M7 = S3 T3
+ *   S4 = A12 - S2    T4 = T2 - B21    M4 = A22 T4
+ *   U2 = M1 + M6, U3 = U2 + M7
+ *   C11 = M1 + M2, C12 = U2 + M5 + M3, C21 = U3 - M4, C22 = U3 + M5
+ * M1, M3, M4 and M5 go straight into their quadrants of C, the rest into
+ * scratch. An odd last row, col or k of the matrices is peeled off and
+ * done classically.
+ *
+ * scratch: strassen_scratch(M, N, K, task_levels) elements, aligned to
+ * GEMM_ALIGN. In the top task_levels levels the 7 products are OpenMP
+ * tasks (call from one thread of a parallel region), and a leaf reached
+ * before they run out is split into tasks by recursive_gemm(). Below
+ * them, every leaf is one call to the kernel and nothing is allocated on
+ * the way down.
+ */
+void strassen(const int M, const int N, const int K,
+              const gemm_elem* const A, const int lda,
+              const gemm_elem* const B, const int ldb,
+              gemm_acc* const C, const int ldc,
+              gemm_acc* const scratch, const int task_levels) {
+    if (M < STRASSEN_CROSSOVER || N < STRASSEN_CROSSOVER || K < STRASSEN_CROSSOVER) {
+        if (task_levels > 0) {
+            // Fewer products than threads: split this one into tasks too,
+            // as many pieces as the missing levels' products would have
+            // been (see recursive_gemm()).
+            long long cutoff = (long long)M * N * K / RECURSE_PIECES;
+            for (int l = 0; l < task_levels; l++) {
+                cutoff /= 7;
+            }
+            cutoff = (cutoff < RECURSE_CUTOFF) ? cutoff : RECURSE_CUTOFF;
+            cutoff = (cutoff > 1) ? cutoff : 1;
+
+            for (int r = 0; r < M; r++) {
+                memset(&C[r * ldc], 0, N * sizeof(gemm_acc));
+            }
+            recursive_gemm(M, N, K, A, lda, B, ldb, C, ldc, cutoff);
+        }
+        else {
+            gemm_packed(M, N, K, A, lda, B, ldb, C, ldc, scratch);
         }
+        return;
+    }
+
+    const int m = M / 2, n = N / 2, k = K / 2;
+    const gemm_elem* const A11 = A;
+    const gemm_elem* const A12 = &A[k];
+    const gemm_elem* const A21 = &A[m * lda];
+    const gemm_elem* const A22 = &A[m * lda + k];
+    const gemm_elem* const B11 = B;
+    const gemm_elem* const B12 = &B[n];
+    const gemm_elem* const B21 = &B[k * ldb];
+    const gemm_elem* const B22 = &B[k * ldb + n];
+    gemm_acc* const C11 = C;
+    gemm_acc* const C12 = &C[n];
+    gemm_acc* const C21 = &C[m * ldc];
+    gemm_acc* const C22 = &C[m * ldc + n];
+
+    // This level's share of the arena, then the products' arenas.
+    gemm_elem* S[4], * T[4];
+    for (int i = 0; i < 4; i++) {
+        S[i] = &scratch[(size_t)i * m * k];
+        T[i] = &scratch[(size_t)4 * m * k + (size_t)i * k * n];
+    }
+    gemm_acc* const P2 = &scratch[(size_t)4 * m * k + (size_t)4 * k * n];
+    gemm_acc* const P6 = &P2[(size_t)m * n];
+    gemm_acc* const P7 = &P6[(size_t)m * n];
+    gemm_acc* const children = &scratch[GEMM_ROUND_UP((size_t)4 * m * k + (size_t)4 * k * n + (size_t)3 * m * n,
+                                                       GEMM_ALIGN / sizeof(gemm_acc))];
+    const int levels = (task_levels > 0) ? task_levels - 1 : 0;
+    const size_t child = (task_levels > 0) ? strassen_scratch(m, n, k, levels) : 0;
+
+    mat_add(m, k, A21, lda, A22, lda, S[0], k, 1);
+    mat_add(m, k, S[0], k, A11, lda, S[1], k, -1);
+    mat_add(m, k, A11, lda, A21, lda, S[2], k, -1);
+    mat_add(m, k, A12, lda, S[1], k, S[3], k, -1);
+    mat_add(k, n, B12, ldb, B11, ldb, T[0], n, -1);
+    mat_add(k, n, B22, ldb, T[0], n, T[1], n, -1);
+    mat_add(k, n, B22, ldb, B12, ldb, T[2], n, -1);
+    mat_add(k, n, T[1], n, B21, ldb, T[3], n, -1);
+
+    // Task i gets children + i * child; sequential levels share one arena.
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, A11, lda, B11, ldb, C11, ldc, children, levels);
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, A12, lda, B21, ldb, P2, n, &children[1 * child], levels);
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, S[3], k, B22, ldb, C12, ldc, &children[2 * child], levels);
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, A22, lda, T[3], n, C21, ldc, &children[3 * child], levels);
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, S[0], k, T[0], n, C22, ldc, &children[4 * child], levels);
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, S[1], k, T[1], n, P6, n, &children[5 * child], levels);
+    #pragma omp task if(task_levels > 0)
+    strassen(m, n, k, S[2], k, T[2], n, P7, n, &children[6 * child], levels);
+    #pragma omp taskwait
+
+    mat_add(m, n, C11, ldc, P6, n, P6, n, 1);   // U2 = M1 + M6
+    mat_add(m, n, C11, ldc, P2, n, C11, ldc, 1); // C11 = M1 + M2
+    mat_add(m, n, P6, n, P7, n, P7, n, 1);      // U3 = U2 + M7
+    mat_add(m, n, P6, n, C22, ldc, P6, n, 1);   // U4 = U2 + M5
+    mat_add(m, n, P6, n, C12, ldc, C12, ldc, 1); // C12 = U4 + M3
+    mat_add(m, n, P7, n, C21, ldc, C21, ldc, -1); // C21 = U3 - M4
+    mat_add(m, n, P7, n, C22, ldc, C22, ldc, 1); // C22 = U3 + M5
+
+    // The odd last k, col and row, if any, packed where the products were.
+    if (K > 2 * k) {
+        gemm_accumulate_packed(2 * m, 2 * n, 1, &A[2 * k], lda, &B[2 * k * ldb], ldb, C, ldc, children);
+    }
+    if (N > 2 * n) {
+        gemm_packed(2 * m, 1, K, A, lda, &B[2 * n], ldb, &C[2 * n], ldc, children);
+    }
+    if (M > 2 * m) {
+        gemm_packed(1, N, K, &A[2 * m * lda], lda, B, ldb, &C[2 * m * ldc], ldc, children);
     }
 }
+#endif // !GEMM_WIDEN
 
 
 //////////////////////////////
@@ -80,8 +443,10 @@ int main(int argc, char* argv[]) {
     // 3 args + 1 for the first arg, which is always the process name
     DP("argc = %d\n", argc);
 
-    if (argc != 3 + 1) {
-        printf("Usage: ./matmult <rows in A> <cols in A/rows in B> <cols in B>");
+    if (argc < 3 + 1 || argc > 5 + 1) {
+        printf("Usage: ./matmult <rows in A> <cols in A/rows in B> <cols in B> [first-touch | interleave | bind] [rows | recursive | strassen]\n");
+        printf("  recursive splits the work into tasks rather than bands of rows; interleave suits it best.\n");
+        printf("  strassen does 7 products instead of 8 per halving, down to %d (then like recursive).\n", STRASSEN_CROSSOVER);
         exit(EXIT_FAILURE);
     }
 
@@ -89,46 +454,127 @@ int main(int argc, char* argv[]) {
     const int NCA_RB = atof(argv[2]);
     const int NCB = atof(argv[3]);
 
-    // Define arrays
-    int A[NRA][NCA_RB];
-    init_matrix(NRA, NCA_RB, A, '+');
-    DBG(print_matrix(NRA, NCA_RB, (const int (*)[])A);)
+    enum placement placement = PLACE_FIRST_TOUCH;
+    if (argc > 4) {
+        for (placement = 0; placement < NUM_PLACEMENTS; placement++) {
+            if (strcmp(argv[4], placement_names[placement]) == 0) {
+                break;
+            }
+        }
+    }
 
-    int B[NCA_RB][NCB];
-    init_matrix(NCA_RB, NCB, B, '-');
-    DBG(print_matrix(NCA_RB, NCB, (const int (*)[])B);)
+    enum mode mode = MODE_ROWS;
+    if (argc > 5) {
+        for (mode = 0; mode < NUM_MODES; mode++) {
+            if (strcmp(argv[5], mode_names[mode]) == 0) {
+                break;
+            }
+        }
+    }
 
-    int C[NRA][NCB];
+    if (NRA <= 0 || NCA_RB <= 0 || NCB <= 0 || placement == NUM_PLACEMENTS || mode == NUM_MODES) {
+        printf("ERROR: Matrix dimensions must be positive, placement first-touch, interleave or bind, "
+               "and mode rows, recursive or strassen.\n");
+        exit(EXIT_FAILURE);
+    }
+#if GEMM_WIDEN
+    if (mode == MODE_STRASSEN) {
+        printf("ERROR: strassen isn't available with GEMM_WIDEN (its sums of A and B would wrap in int32).\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    // Pages only stay next to the thread that touched them if it can't
+    // migrate to another node.
+    if (placement == PLACE_BIND && omp_get_proc_bind() == omp_proc_bind_false) {
+        printf("ERROR: bind needs pinned threads. Set OMP_PROC_BIND (e.g. spread) and OMP_PLACES (e.g. cores).\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Placement: %s, mode: %s, type: %s\n", placement_names[placement], mode_names[mode], GEMM_TYPE_NAME);
+
+    // Define arrays (on the heap; they don't fit on the stack past a few MB)
+    gemm_elem (* const A)[NCA_RB] = alloc_matrix(NRA, NCA_RB, sizeof(gemm_elem), "A");
+    init_matrix_elem(NRA, NCA_RB, A, '+', placement);
+    DBG(print_matrix(NRA, NCA_RB, (const gemm_elem (*)[])A);)
+
+    gemm_elem (* const B)[NCB] = alloc_matrix(NCA_RB, NCB, sizeof(gemm_elem), "B");
+    init_matrix_elem(NCA_RB, NCB, B, '-', placement);
+    DBG(print_matrix(NCA_RB, NCB, (const gemm_elem (*)[])B);)
+
+    gemm_acc (* const C)[NCB] = alloc_matrix(NRA, NCB, sizeof(gemm_acc), "C");
+    init_matrix_acc(NRA, NCB, C, '0', placement);
 
     DP("Total # threads: %d\n", omp_get_num_threads());
 
+    // Strassen's arena is sized and allocated once, outside the timing. Its
+    // top levels are tasks until there are enough products for the threads.
+#if !GEMM_WIDEN
+    int strassen_levels = 0;
+    for (int products = 1; products < omp_get_max_threads(); products *= 7) {
+        strassen_levels++;
+    }
+    const int use_strassen = mode == MODE_STRASSEN && NRA >= STRASSEN_CROSSOVER && NCB >= STRASSEN_CROSSOVER &&
+                             NCA_RB >= STRASSEN_CROSSOVER;
+    const size_t scratch_size = use_strassen ? strassen_scratch(NRA, NCB, NCA_RB, strassen_levels) : 0;
+    gemm_acc* const scratch = (scratch_size > 0) ? alloc_array(scratch_size, sizeof(gemm_acc), "Strassen's scratch") : NULL;
+#else
+    gemm_acc* const scratch = NULL;
+#endif
+
     const struct timespec start = now();
 
     int tid;
-    #pragma omp parallel shared(A, B, C) private(tid)
-    {
-        DBG(tid = omp_get_thread_num();)
-        DP("Hello from thread %d\n", tid); 
-
-        #pragma omp for // defaults to kind=static, chunk=N/num_threads
-        for (int r = 0; r < NRA; r++) {
-            for (int c = 0; c < NCB; c++) {
-                // Not sure what this inner loop is for 
-                C[r][c] = 0;
-                for (int k = 0; k < NCA_RB; k++) {
-                    C[r][c] += A[r][k] * B[k][c];
-                }
-            } // end of for col
-        } // end of for row
+    if (mode == MODE_STRASSEN && scratch != NULL) {
+#if !GEMM_WIDEN
+        #pragma omp parallel
+        #pragma omp single
+        strassen(NRA, NCB, NCA_RB, &A[0][0], NCA_RB, &B[0][0], NCB, &C[0][0], NCB, scratch, strassen_levels);
+#endif
+    }
+    else if (mode != MODE_ROWS) {
+        // Below the crossover, Strassen is the classical product in tasks.
+        #pragma omp parallel
+        #pragma omp single
+        {
+            #pragma omp taskloop
+            for (int r = 0; r < NRA; r++) {
+                memset(C[r], 0, NCB * sizeof(gemm_acc));
+            }
+
+            long long cutoff = (long long)NRA * NCB * NCA_RB / (RECURSE_PIECES * omp_get_num_threads());
+            cutoff = (cutoff < RECURSE_CUTOFF) ? cutoff : RECURSE_CUTOFF;
+            cutoff = (cutoff > 1) ? cutoff : 1;
+            recursive_gemm(NRA, NCB, NCA_RB, &A[0][0], NCA_RB, &B[0][0], NCB, &C[0][0], NCB, cutoff);
+        }
+    }
+    else {
+        #pragma omp parallel shared(A, B, C) private(tid)
+        {
+            tid = omp_get_thread_num();
+            DP("Hello from thread %d (place %d)\n", tid, omp_get_place_num());
+
+            // Same static split as `omp for` (and as init_matrix()), but each
+            // thread hands its whole band of rows to the blocked kernel in one
+            // call.
+            int first, last;
+            thread_rows(NRA, tid, omp_get_num_threads(), &first, &last);
+
+            gemm(last - first, NCB, NCA_RB, &A[first][0], NCA_RB, &B[0][0], NCB, &C[first][0], NCB);
+        }
     }
 
     const struct timespec stop = now();
     
-    print_matrix(NRA, NCB, (const int (*)[])C);
+    print_result(NRA, NCB, (const gemm_acc (*)[])C);
 
     const double elapsed = tdiff(start, stop);
     printf("Elapsed time: %f sec\n", elapsed);
 
+    free(A);
+    free(B);
+    free(C);
+    free(scratch);
+
     printf("Goodbye.\n");
     return 0;
 }
@@ -0,0 +1,522 @@
+/* gemm.h
+ *
+ * Shared matrix multiply kernel for the matmult programs.
+ *
+ * Computes C = A * B for row-major matrices, where A is MxK, B is KxN and
+ * C is MxN. Each matrix has its own leading dimension (elements per row in
+ * memory), so callers can multiply sub-blocks in place.
+ *
+ * The element type is fixed at compile time (GEMM_TYPE, below): int32,
+ * int64, float or double. A and B are gemm_elem, C is gemm_acc, which is
+ * the same type except for int32 with GEMM_WIDEN, where C is int64.
+ *
+ * The loop nest follows the usual "Goto" layout:
+ *   - B is packed one KC x NC panel at a time (stays in L2/L3),
+ *   - A is packed one MC x KC block at a time (stays in L2),
+ *   - a MR x NR register tile of C is accumulated by the micro-kernel,
+ *     streaming one packed row of B and one packed column of A per k step.
+ * Nothing in the inner loop walks B column-wise or reloads C.
+ *
+ * The micro-kernel is picked at compile time: AVX-512, AVX2, or a plain C
+ * fallback, each specialized to the element type. A tile is two vectors
+ * wide, so 4-byte types get twice the columns (and multiply-adds per
+ * instruction) of 8-byte ones. Build with -march=native (or -mavx2 -mfma /
+ * -mavx512f) to get the vector paths.
+ */
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+//////////////////////////////
+// Element type
+//////////////////////////////
+#define GEMM_INT32 1
+#define GEMM_INT64 2
+#define GEMM_FLOAT 3
+#define GEMM_DOUBLE 4
+
+// Define before including this (or with -D) to pick another type.
+#ifndef GEMM_TYPE
+#define GEMM_TYPE GEMM_INT32
+#endif
+
+// int32 only: sum the products in int64 instead of letting them wrap.
+// A and B stay int32, C becomes int64.
+#ifndef GEMM_WIDEN
+#define GEMM_WIDEN 0
+#endif
+
+// gemm_elem: A and B. gemm_acc: C, and the packed copies of A and B
+// (packing sign-extends them when widening).
+// GEMM_ELEM_FMT / GEMM_ACC_FMT: printf conversions, e.g. "%3" GEMM_ELEM_FMT.
+#if GEMM_TYPE == GEMM_INT32
+typedef int32_t gemm_elem;
+#define GEMM_ELEM_FMT PRId32
+#if GEMM_WIDEN
+typedef int64_t gemm_acc;
+#define GEMM_ACC_FMT PRId64
+#define GEMM_TYPE_NAME "int32 (int64 sums)"
+#else
+typedef int32_t gemm_acc;
+#define GEMM_ACC_FMT PRId32
+#define GEMM_TYPE_NAME "int32"
+#endif
+#elif GEMM_TYPE == GEMM_INT64
+typedef int64_t gemm_elem;
+typedef int64_t gemm_acc;
+#define GEMM_ELEM_FMT PRId64
+#define GEMM_ACC_FMT PRId64
+#define GEMM_TYPE_NAME "int64"
+#elif GEMM_TYPE == GEMM_FLOAT
+typedef float gemm_elem;
+typedef float gemm_acc;
+#define GEMM_ELEM_FMT "g"
+#define GEMM_ACC_FMT "g"
+#define GEMM_TYPE_NAME "float"
+#elif GEMM_TYPE == GEMM_DOUBLE
+typedef double gemm_elem;
+typedef double gemm_acc;
+#define GEMM_ELEM_FMT "g"
+#define GEMM_ACC_FMT "g"
+#define GEMM_TYPE_NAME "double"
+#else
+#error "GEMM_TYPE must be GEMM_INT32, GEMM_INT64, GEMM_FLOAT or GEMM_DOUBLE"
+#endif
+
+#if GEMM_WIDEN && GEMM_TYPE != GEMM_INT32
+#error "GEMM_WIDEN only applies to GEMM_INT32"
+#endif
+
+#define GEMM_IS_FLOAT (GEMM_TYPE == GEMM_FLOAT || GEMM_TYPE == GEMM_DOUBLE)
+
+// Matching MPI datatypes, for programs that include mpi.h first.
+#ifdef MPI_VERSION
+#if GEMM_TYPE == GEMM_INT32
+#define MPI_GEMM_ELEM MPI_INT32_T
+#define MPI_GEMM_ACC (GEMM_WIDEN ? MPI_INT64_T : MPI_INT32_T)
+#elif GEMM_TYPE == GEMM_INT64
+#define MPI_GEMM_ELEM MPI_INT64_T
+#define MPI_GEMM_ACC MPI_INT64_T
+#elif GEMM_TYPE == GEMM_FLOAT
+#define MPI_GEMM_ELEM MPI_FLOAT
+#define MPI_GEMM_ACC MPI_FLOAT
+#else
+#define MPI_GEMM_ELEM MPI_DOUBLE
+#define MPI_GEMM_ACC MPI_DOUBLE
+#endif
+#endif
+
+//////////////////////////////
+// Vector operations
+//////////////////////////////
+// One table per ISA and type. The micro-kernel only uses these, so each
+// type gets its own SIMD path from the same loop:
+//   gemm_vec: a register of GEMM_LANES gemm_acc
+//   gemm_vmadd(c, a, b): c + a * b
+// int64 has no vector multiply before AVX-512DQ; without it (and without
+// AVX2/AVX-512 at all) GEMM_LANES stays undefined and the kernel is scalar.
+#if defined(__AVX512F__)
+#if GEMM_TYPE == GEMM_FLOAT
+typedef __m512 gemm_vec;
+#define GEMM_LANES 16
+#define gemm_vzero() _mm512_setzero_ps()
+#define gemm_vset1(x) _mm512_set1_ps(x)
+#define gemm_vload(p) _mm512_load_ps(p)
+#define gemm_vloadu(p) _mm512_loadu_ps(p)
+#define gemm_vstore(p, v) _mm512_store_ps(p, v)
+#define gemm_vstoreu(p, v) _mm512_storeu_ps(p, v)
+#define gemm_vadd(x, y) _mm512_add_ps(x, y)
+#define gemm_vmadd(c, a, b) _mm512_fmadd_ps(a, b, c)
+#elif GEMM_TYPE == GEMM_DOUBLE
+typedef __m512d gemm_vec;
+#define GEMM_LANES 8
+#define gemm_vzero() _mm512_setzero_pd()
+#define gemm_vset1(x) _mm512_set1_pd(x)
+#define gemm_vload(p) _mm512_load_pd(p)
+#define gemm_vloadu(p) _mm512_loadu_pd(p)
+#define gemm_vstore(p, v) _mm512_store_pd(p, v)
+#define gemm_vstoreu(p, v) _mm512_storeu_pd(p, v)
+#define gemm_vadd(x, y) _mm512_add_pd(x, y)
+#define gemm_vmadd(c, a, b) _mm512_fmadd_pd(a, b, c)
+#elif GEMM_TYPE == GEMM_INT32 && !GEMM_WIDEN
+typedef __m512i gemm_vec;
+#define GEMM_LANES 16
+#define gemm_vset1(x) _mm512_set1_epi32(x)
+#define gemm_vadd(x, y) _mm512_add_epi32(x, y)
+#define gemm_vmadd(c, a, b) _mm512_add_epi32(c, _mm512_mullo_epi32(a, b))
+#elif GEMM_TYPE == GEMM_INT32
+// The packed values are sign-extended int32, which is what mul_epi32
+// multiplies (the low half of each 64-bit lane) into a full int64.
+typedef __m512i gemm_vec;
+#define GEMM_LANES 8
+#define gemm_vset1(x) _mm512_set1_epi64(x)
+#define gemm_vadd(x, y) _mm512_add_epi64(x, y)
+#define gemm_vmadd(c, a, b) _mm512_add_epi64(c, _mm512_mul_epi32(a, b))
+#elif defined(__AVX512DQ__)
+typedef __m512i gemm_vec;
+#define GEMM_LANES 8
+#define gemm_vset1(x) _mm512_set1_epi64(x)
+#define gemm_vadd(x, y) _mm512_add_epi64(x, y)
+#define gemm_vmadd(c, a, b) _mm512_add_epi64(c, _mm512_mullo_epi64(a, b))
+#endif
+#if defined(GEMM_LANES) && !GEMM_IS_FLOAT
+#define gemm_vzero() _mm512_setzero_si512()
+#define gemm_vload(p) _mm512_load_si512((const void*)(p))
+#define gemm_vloadu(p) _mm512_loadu_si512((const void*)(p))
+#define gemm_vstore(p, v) _mm512_store_si512((void*)(p), v)
+#define gemm_vstoreu(p, v) _mm512_storeu_si512((void*)(p), v)
+#endif
+
+#elif defined(__AVX2__)
+#if GEMM_TYPE == GEMM_FLOAT
+typedef __m256 gemm_vec;
+#define GEMM_LANES 8
+#define gemm_vzero() _mm256_setzero_ps()
+#define gemm_vset1(x) _mm256_set1_ps(x)
+#define gemm_vload(p) _mm256_load_ps(p)
+#define gemm_vloadu(p) _mm256_loadu_ps(p)
+#define gemm_vstore(p, v) _mm256_store_ps(p, v)
+#define gemm_vstoreu(p, v) _mm256_storeu_ps(p, v)
+#define gemm_vadd(x, y) _mm256_add_ps(x, y)
+#ifdef __FMA__
+#define gemm_vmadd(c, a, b) _mm256_fmadd_ps(a, b, c)
+#else
+#define gemm_vmadd(c, a, b) _mm256_add_ps(c, _mm256_mul_ps(a, b))
+#endif
+#elif GEMM_TYPE == GEMM_DOUBLE
+typedef __m256d gemm_vec;
+#define GEMM_LANES 4
+#define gemm_vzero() _mm256_setzero_pd()
+#define gemm_vset1(x) _mm256_set1_pd(x)
+#define gemm_vload(p) _mm256_load_pd(p)
+#define gemm_vloadu(p) _mm256_loadu_pd(p)
+#define gemm_vstore(p, v) _mm256_store_pd(p, v)
+#define gemm_vstoreu(p, v) _mm256_storeu_pd(p, v)
+#define gemm_vadd(x, y) _mm256_add_pd(x, y)
+#ifdef __FMA__
+#define gemm_vmadd(c, a, b) _mm256_fmadd_pd(a, b, c)
+#else
+#define gemm_vmadd(c, a, b) _mm256_add_pd(c, _mm256_mul_pd(a, b))
+#endif
+#elif GEMM_TYPE == GEMM_INT32 && !GEMM_WIDEN
+typedef __m256i gemm_vec;
+#define GEMM_LANES 8
+#define gemm_vset1(x) _mm256_set1_epi32(x)
+#define gemm_vadd(x, y) _mm256_add_epi32(x, y)
+#define gemm_vmadd(c, a, b) _mm256_add_epi32(c, _mm256_mullo_epi32(a, b))
+#elif GEMM_TYPE == GEMM_INT32
+typedef __m256i gemm_vec;
+#define GEMM_LANES 4
+#define gemm_vset1(x) _mm256_set1_epi64x(x)
+#define gemm_vadd(x, y) _mm256_add_epi64(x, y)
+#define gemm_vmadd(c, a, b) _mm256_add_epi64(c, _mm256_mul_epi32(a, b))
+#endif
+#if defined(GEMM_LANES) && !GEMM_IS_FLOAT
+#define gemm_vzero() _mm256_setzero_si256()
+#define gemm_vload(p) _mm256_load_si256((const __m256i*)(p))
+#define gemm_vloadu(p) _mm256_loadu_si256((const __m256i*)(p))
+#define gemm_vstore(p, v) _mm256_store_si256((__m256i*)(p), v)
+#define gemm_vstoreu(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#endif
+#endif
+
+//////////////////////////////
+// Blocking parameters
+//////////////////////////////
+// Register tile. NR is two vectors wide so each k step issues 2*MR
+// independent multiply-adds, enough to hide the multiply latency.
+#if defined(GEMM_LANES)
+#define GEMM_MR 6
+#define GEMM_NR (2 * GEMM_LANES)
+#if defined(__AVX512F__)
+#define GEMM_ISA "avx512"
+#else
+#define GEMM_ISA "avx2"
+#endif
+#else
+#define GEMM_MR 4
+#define GEMM_NR 4
+#define GEMM_ISA "scalar"
+#endif
+
+// Cache blocks. Can be overridden with -D for tuning.
+// MC must be a multiple of MR and NC a multiple of NR.
+// Sizes are for 4-byte packed values; 8-byte ones (int64, double and
+// widened int32) take twice the room, but their tiles are half as wide.
+#ifndef GEMM_MC
+#define GEMM_MC 72   /* rows of A per packed block (MC*KC*4B ~ 72KB, L2) */
+#endif
+#ifndef GEMM_KC
+#define GEMM_KC 256  /* depth of each packed panel (KC*NR*4B ~ 16-32KB, L1) */
+#endif
+#ifndef GEMM_NC
+#define GEMM_NC 2048 /* cols of B per packed panel (KC*NC*4B ~ 2MB, L3) */
+#endif
+
+#define GEMM_ALIGN 64
+#define GEMM_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define GEMM_ROUND_UP(x, m) ((((x) + (m) - 1) / (m)) * (m))
+
+//////////////////////////////
+// Packing
+//////////////////////////////
+/**
+ * Allocate a cache-line aligned buffer of n gemm_acc.
+ */
+static inline gemm_acc* gemm_alloc(const size_t n) {
+    const size_t bytes = GEMM_ROUND_UP(n * sizeof(gemm_acc), GEMM_ALIGN);
+    gemm_acc* const buf = aligned_alloc(GEMM_ALIGN, bytes ? bytes : GEMM_ALIGN);
+    if (buf == NULL) {
+        printf("ERROR: Couldn't allocate gemm packing buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+/**
+ * Copy an mc x kc block of A into strips of MR rows.
+ * Within a strip, the MR values for one k are contiguous, which is
+ * exactly the order the micro-kernel broadcasts them in.
+ * Rows past mc are zero-padded so the kernel never branches.
+ */
+static inline void gemm_pack_a(const int mc, const int kc, const gemm_elem* const A, const int lda, gemm_acc* packed) {
+    for (int i = 0; i < mc; i += GEMM_MR) {
+        const int m = GEMM_MIN(GEMM_MR, mc - i);
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < m; r++) {
+                packed[r] = A[(i + r) * lda + p];
+            }
+            for (int r = m; r < GEMM_MR; r++) {
+                packed[r] = 0;
+            }
+            packed += GEMM_MR;
+        }
+    }
+}
+
+/**
+ * Copy a kc x nc panel of B into strips of NR columns.
+ * Within a strip, the NR values for one k are contiguous so they can be
+ * loaded straight into vector registers.
+ * Columns past nc are zero-padded.
+ */
+static inline void gemm_pack_b(const int kc, const int nc, const gemm_elem* const B, const int ldb, gemm_acc* packed) {
+    for (int j = 0; j < nc; j += GEMM_NR) {
+        const int n = GEMM_MIN(GEMM_NR, nc - j);
+        for (int p = 0; p < kc; p++) {
+            const gemm_elem* const row = &B[p * ldb + j];
+            for (int c = 0; c < n; c++) {
+                packed[c] = row[c];
+            }
+            for (int c = n; c < GEMM_NR; c++) {
+                packed[c] = 0;
+            }
+            packed += GEMM_NR;
+        }
+    }
+}
+
+//////////////////////////////
+// Micro-kernel
+//////////////////////////////
+/**
+ * Add the m x n corner of a full MR x NR tile into C.
+ * Used for the ragged right/bottom edges of the matrix.
+ */
+static inline void gemm_store_partial(const gemm_acc* const tile, gemm_acc* const C, const int ldc, const int m, const int n) {
+    for (int r = 0; r < m; r++) {
+        for (int c = 0; c < n; c++) {
+            C[r * ldc + c] += tile[r * GEMM_NR + c];
+        }
+    }
+}
+
+/**
+ * C[0:m][0:n] += a_strip * b_strip over kc steps.
+ * a: packed MR x kc strip of A.
+ * b: packed kc x NR strip of B.
+ * m, n: valid part of the tile (m <= MR, n <= NR).
+ */
+static inline void gemm_micro_kernel(const int kc, const gemm_acc* const a, const gemm_acc* const b,
+                                     gemm_acc* const C, const int ldc, const int m, const int n) {
+#if defined(GEMM_LANES)
+    gemm_vec c0[GEMM_MR], c1[GEMM_MR];
+    for (int r = 0; r < GEMM_MR; r++) {
+        c0[r] = gemm_vzero();
+        c1[r] = gemm_vzero();
+    }
+
+    for (int p = 0; p < kc; p++) {
+        const gemm_vec b0 = gemm_vload(&b[p * GEMM_NR]);
+        const gemm_vec b1 = gemm_vload(&b[p * GEMM_NR + GEMM_LANES]);
+        for (int r = 0; r < GEMM_MR; r++) {
+            const gemm_vec ar = gemm_vset1(a[p * GEMM_MR + r]);
+            c0[r] = gemm_vmadd(c0[r], ar, b0);
+            c1[r] = gemm_vmadd(c1[r], ar, b1);
+        }
+    }
+
+    if (m == GEMM_MR && n == GEMM_NR) {
+        for (int r = 0; r < GEMM_MR; r++) {
+            gemm_acc* const row = &C[r * ldc];
+            gemm_vstoreu(row, gemm_vadd(c0[r], gemm_vloadu(row)));
+            gemm_vstoreu(row + GEMM_LANES, gemm_vadd(c1[r], gemm_vloadu(row + GEMM_LANES)));
+        }
+        return;
+    }
+
+    _Alignas(GEMM_ALIGN) gemm_acc tile[GEMM_MR * GEMM_NR];
+    for (int r = 0; r < GEMM_MR; r++) {
+        gemm_vstore(&tile[r * GEMM_NR], c0[r]);
+        gemm_vstore(&tile[r * GEMM_NR + GEMM_LANES], c1[r]);
+    }
+    gemm_store_partial(tile, C, ldc, m, n);
+
+#else
+    gemm_acc tile[GEMM_MR * GEMM_NR] = {0};
+    for (int p = 0; p < kc; p++) {
+        for (int r = 0; r < GEMM_MR; r++) {
+            const gemm_acc ar = a[p * GEMM_MR + r];
+            for (int c = 0; c < GEMM_NR; c++) {
+                tile[r * GEMM_NR + c] += ar * b[p * GEMM_NR + c];
+            }
+        }
+    }
+    gemm_store_partial(tile, C, ldc, m, n);
+#endif
+}
+
+//////////////////////////////
+// Public interface
+//////////////////////////////
+/**
+ * Room for a packed block of A, rounded up to a cache line: where the
+ * panel of B starts in gemm_pack_size()'s buffer.
+ */
+static inline size_t gemm_pack_size_a(const int M, const int K) {
+    return GEMM_ROUND_UP((size_t)GEMM_ROUND_UP(GEMM_MIN(M, GEMM_MC), GEMM_MR) * GEMM_MIN(K, GEMM_KC),
+                         GEMM_ALIGN / sizeof(gemm_acc));
+}
+
+/**
+ * Elements of the packing buffer gemm_accumulate_packed() needs for an
+ * M x N x K product: room for a block of A, then a panel of B, each
+ * starting on a cache line. Always a whole number of cache lines, so
+ * buffers can be laid end to end in one aligned arena.
+ */
+static inline size_t gemm_pack_size(const int M, const int N, const int K) {
+    if (M <= 0 || N <= 0 || K <= 0) {
+        return 0;
+    }
+    return gemm_pack_size_a(M, K) +
+           GEMM_ROUND_UP((size_t)GEMM_ROUND_UP(GEMM_MIN(N, GEMM_NC), GEMM_NR) * GEMM_MIN(K, GEMM_KC),
+                         GEMM_ALIGN / sizeof(gemm_acc));
+}
+
+/**
+ * C += A * B.
+ * M: rows of A and C
+ * N: cols of B and C
+ * K: cols of A / rows of B
+ * lda, ldb, ldc: row strides of A, B and C (in elements).
+ * packed: a GEMM_ALIGN-aligned buffer of at least gemm_pack_size(M, N, K)
+ * elements, for callers that multiply many blocks and don't want to
+ * allocate it every time.
+ *
+ * Not internally threaded; callers split rows of A/C across threads or
+ * ranks and call this on each piece.
+ */
+static inline void gemm_accumulate_packed(const int M, const int N, const int K,
+                                          const gemm_elem* const A, const int lda,
+                                          const gemm_elem* const B, const int ldb,
+                                          gemm_acc* const C, const int ldc,
+                                          gemm_acc* const packed) {
+    if (M <= 0 || N <= 0 || K <= 0) {
+        return;
+    }
+
+    gemm_acc* const packed_a = packed;
+    gemm_acc* const packed_b = &packed[gemm_pack_size_a(M, K)];
+
+    for (int jc = 0; jc < N; jc += GEMM_NC) {
+        const int nc = GEMM_MIN(GEMM_NC, N - jc);
+
+        for (int pc = 0; pc < K; pc += GEMM_KC) {
+            const int kc = GEMM_MIN(GEMM_KC, K - pc);
+            gemm_pack_b(kc, nc, &B[pc * ldb + jc], ldb, packed_b);
+
+            for (int ic = 0; ic < M; ic += GEMM_MC) {
+                const int mc = GEMM_MIN(GEMM_MC, M - ic);
+                gemm_pack_a(mc, kc, &A[ic * lda + pc], lda, packed_a);
+
+                for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                    for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                        gemm_micro_kernel(
+                            kc,
+                            &packed_a[ir * kc],
+                            &packed_b[jr * kc],
+                            &C[(ic + ir) * ldc + jc + jr],
+                            ldc,
+                            GEMM_MIN(GEMM_MR, mc - ir),
+                            GEMM_MIN(GEMM_NR, nc - jr)
+                        );
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * C = A * B. Same arguments as gemm_accumulate_packed().
+ */
+static inline void gemm_packed(const int M, const int N, const int K,
+                               const gemm_elem* const A, const int lda,
+                               const gemm_elem* const B, const int ldb,
+                               gemm_acc* const C, const int ldc,
+                               gemm_acc* const packed) {
+    for (int r = 0; r < M; r++) {
+        memset(&C[r * ldc], 0, N * sizeof(gemm_acc));
+    }
+    gemm_accumulate_packed(M, N, K, A, lda, B, ldb, C, ldc, packed);
+}
+
+/**
+ * C += A * B, packing into a buffer of its own.
+ */
+static inline void gemm_accumulate(const int M, const int N, const int K,
+                                   const gemm_elem* const A, const int lda,
+                                   const gemm_elem* const B, const int ldb,
+                                   gemm_acc* const C, const int ldc) {
+    if (M <= 0 || N <= 0 || K <= 0) {
+        return;
+    }
+
+    gemm_acc* const packed = gemm_alloc(gemm_pack_size(M, N, K));
+    gemm_accumulate_packed(M, N, K, A, lda, B, ldb, C, ldc, packed);
+    free(packed);
+}
+
+/**
+ * C = A * B, packing into a buffer of its own.
+ */
+static inline void gemm(const int M, const int N, const int K,
+                        const gemm_elem* const A, const int lda,
+                        const gemm_elem* const B, const int ldb,
+                        gemm_acc* const C, const int ldc) {
+    for (int r = 0; r < M; r++) {
+        memset(&C[r * ldc], 0, N * sizeof(gemm_acc));
+    }
+    gemm_accumulate(M, N, K, A, lda, B, ldb, C, ldc);
+}
+
+#endif // GEMM_H
@@ -0,0 +1,46 @@
+/* kahan.h
+ *
+ * Compensated summation (Neumaier's variant of Kahan).
+ *
+ * Adding billions of small terms into one double loses the low bits of
+ * every term once the running sum gets large. A kahan_sum carries those
+ * lost bits in a separate compensation term, so the error stays at a few
+ * ulps of the result instead of growing with the number of terms.
+ *
+ * Don't build users with -ffast-math: it lets the compiler reassociate
+ * (sum - t) + x back to 0 and silently undo the compensation.
+ */
+#ifndef KAHAN_H
+#define KAHAN_H
+
+#include <math.h>
+
+typedef struct {
+    double sum;  /* running sum */
+    double c;    /* low-order bits lost from sum so far */
+} kahan_sum;
+
+static inline void kahan_add(kahan_sum* const k, const double x) {
+    const double t = k->sum + x;
+    if (fabs(k->sum) >= fabs(x)) {
+        k->c += (k->sum - t) + x;
+    }
+    else {
+        k->c += (x - t) + k->sum;
+    }
+    k->sum = t;
+}
+
+/**
+ * Fold one partial sum into another (e.g. per-thread sums).
+ */
+static inline void kahan_merge(kahan_sum* const into, const kahan_sum* const from) {
+    kahan_add(into, from->sum);
+    into->c += from->c;
+}
+
+static inline double kahan_total(const kahan_sum k) {
+    return k.sum + k.c;
+}
+
+#endif // KAHAN_H
@@ -0,0 +1,163 @@
+/* philox.h
+ *
+ * Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11).
+ *
+ * Philox is a keyed bijection: the random bits for counter i under key k
+ * are philox4x32(i, k), with no state carried from one number to the next.
+ * That gives us:
+ *   - independent streams for free: a rank or thread just starts at a
+ *     different counter, there's nothing to seed or split,
+ *   - thread safety: a stream is two integers owned by the caller,
+ *   - reproducibility: sample i is the same number no matter which rank or
+ *     thread draws it, so any (ranks x threads) split of the same sample
+ *     range sees the same samples.
+ *
+ * Every Philox block (4 x 32 bits) yields two uniform doubles with 53 random
+ * bits each, so sample index s lives in block s / 2.
+ */
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u  /* golden ratio */
+#define PHILOX_W1 0xBB67AE85u  /* sqrt(3) - 1 */
+#define PHILOX_ROUNDS 10
+
+// Uniform doubles generated per call inside philox_fill_uniform().
+#define PHILOX_BATCH 256
+
+/**
+ * One stream of uniform samples.
+ * key: the seed, shared by every rank and thread that should see the same sequence.
+ * counter: index of the next sample this stream hands out.
+ */
+typedef struct {
+    uint64_t key;
+    uint64_t counter;
+} philox_stream;
+
+/**
+ * Start a stream at sample index `first`.
+ */
+static inline philox_stream philox_stream_at(const uint64_t key, const uint64_t first) {
+    return (philox_stream) { .key = key, .counter = first };
+}
+
+/**
+ * The raw Philox4x32-10 block function.
+ * ctr: 4 x 32-bit counter (updated in place to the output).
+ * key: 2 x 32-bit key.
+ */
+static inline void philox4x32_10(uint32_t ctr[4], const uint32_t key[2]) {
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        const uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+        const uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+        const uint32_t c1 = ctr[1], c3 = ctr[3];
+
+        ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        ctr[3] = (uint32_t)p0;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+/**
+ * Turn 64 random bits into a double in [0, 1) (top 53 bits).
+ */
+static inline double philox_to_double(const uint32_t hi, const uint32_t lo) {
+    const uint64_t bits = ((uint64_t)hi << 32 | lo) >> 11;
+    return bits * 0x1.0p-53;
+}
+
+/**
+ * The uniform double for one sample index.
+ */
+static inline double philox_uniform_at(const uint64_t key, const uint64_t index) {
+    const uint64_t block = index / 2;
+    uint32_t ctr[4] = {(uint32_t)block, (uint32_t)(block >> 32), 0, 0};
+    const uint32_t k[2] = {(uint32_t)key, (uint32_t)(key >> 32)};
+
+    philox4x32_10(ctr, k);
+
+    return (index & 1) ? philox_to_double(ctr[2], ctr[3]) : philox_to_double(ctr[0], ctr[1]);
+}
+
+/**
+ * Next uniform double in [0, 1) from a stream.
+ * Prefer philox_fill_uniform() for anything in a hot loop.
+ */
+static inline double philox_next(philox_stream* const stream) {
+    return philox_uniform_at(stream->key, stream->counter++);
+}
+
+/**
+ * Fill out[0..n) with the stream's next n uniform doubles in [0, 1).
+ *
+ * Works on PHILOX_BATCH samples at a time with the four counter words in
+ * separate arrays, so every round is a straight-line loop over independent
+ * lanes that the compiler turns into vector multiplies (vpmuludq).
+ */
+static inline void philox_fill_uniform(philox_stream* const stream, double* out, size_t n) {
+    const uint32_t key0 = (uint32_t)stream->key;
+    const uint32_t key1 = (uint32_t)(stream->key >> 32);
+
+    // An odd start would split a block; do that sample on its own.
+    if (n > 0 && (stream->counter & 1)) {
+        *out++ = philox_next(stream);
+        n--;
+    }
+
+    uint32_t c0[PHILOX_BATCH / 2], c1[PHILOX_BATCH / 2], c2[PHILOX_BATCH / 2], c3[PHILOX_BATCH / 2];
+
+    while (n >= 2) {
+        const size_t pairs = (n / 2 < PHILOX_BATCH / 2) ? n / 2 : PHILOX_BATCH / 2;
+        const uint64_t block = stream->counter / 2;
+
+        for (size_t i = 0; i < pairs; i++) {
+            c0[i] = (uint32_t)(block + i);
+            c1[i] = (uint32_t)((block + i) >> 32);
+            c2[i] = 0;
+            c3[i] = 0;
+        }
+
+        uint32_t k0 = key0, k1 = key1;
+        for (int round = 0; round < PHILOX_ROUNDS; round++) {
+            for (size_t i = 0; i < pairs; i++) {
+                const uint64_t p0 = (uint64_t)PHILOX_M0 * c0[i];
+                const uint64_t p1 = (uint64_t)PHILOX_M1 * c2[i];
+                const uint32_t old1 = c1[i], old3 = c3[i];
+
+                c0[i] = (uint32_t)(p1 >> 32) ^ old1 ^ k0;
+                c1[i] = (uint32_t)p1;
+                c2[i] = (uint32_t)(p0 >> 32) ^ old3 ^ k1;
+                c3[i] = (uint32_t)p0;
+            }
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+
+        for (size_t i = 0; i < pairs; i++) {
+            out[2 * i] = philox_to_double(c0[i], c1[i]);
+            out[2 * i + 1] = philox_to_double(c2[i], c3[i]);
+        }
+
+        out += 2 * pairs;
+        n -= 2 * pairs;
+        stream->counter += 2 * pairs;
+    }
+
+    if (n == 1) {
+        *out = philox_next(stream);
+    }
+}
+
+#endif // PHILOX_H
@@ -0,0 +1,220 @@
+/* stencil.h
+ *
+ * Shared 2D stencil (image filter) kernel for the filter programs.
+ *
+ * Computes out = sum(weights * in) / divisor over a (2r+1) x (2r+1)
+ * neighbourhood, r = 1 or 2, for every element of a block of a row-major
+ * matrix of STENCIL_PIXEL (int unless defined before including this).
+ * Like gemm.h, every matrix has its own leading dimension so callers can
+ * filter sub-blocks of a larger buffer in place.
+ *
+ * Two ways of describing the weights:
+ *   - separable: weights = col (outer product) row, plus an extra weight on
+ *     the center. Compact to write down; expanded to full weights when the
+ *     kernel is specialized.
+ *   - full: any (2r+1) x (2r+1) weights.
+ * A filter may sum several terms, optionally taking |term| first (Sobel).
+ *
+ * Each built-in kernel gets its own copy of the filter loop with the
+ * weights and divisor as compile-time constants, so zero weights vanish
+ * and the division becomes a multiply. The loop runs along a row, so it
+ * vectorizes across columns (`#pragma omp simd`, build with -fopenmp or
+ * -fopenmp-simd).
+ *
+ * A single pass straight from the input rows is as fast as it gets here:
+ * at 3x3 and 5x5 the filter is bound by memory traffic, not by arithmetic,
+ * and buffering row sums (sliding sums, column tiles) only adds traffic.
+ */
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+//////////////////////////////
+// Parameters
+//////////////////////////////
+#define STENCIL_MAX_RADIUS 2
+#define STENCIL_MAX_WIDTH (2 * STENCIL_MAX_RADIUS + 1)
+#define STENCIL_MAX_TERMS 2
+
+// Element type of the matrices (e.g. uint8_t pixels). Sums are always
+// accumulated in int, whatever the element type.
+#ifndef STENCIL_PIXEL
+#define STENCIL_PIXEL int
+#endif
+typedef STENCIL_PIXEL stencil_pixel;
+
+// STENCIL_PIXEL_MAX: if defined, results are clamped to [0, STENCIL_PIXEL_MAX]
+// before they're stored, so filters that can overshoot don't wrap around in a narrow type.
+// The built-in filters stay in range anyway.
+
+//////////////////////////////
+// Kernels
+//////////////////////////////
+/**
+ * One weighted sum over the neighbourhood.
+ * Only the first 2r+1 entries of col/row/weights are used.
+ */
+struct stencil_term {
+    int separable;
+    int col[STENCIL_MAX_WIDTH];   // separable: weight of each row (top to bottom)
+    int row[STENCIL_MAX_WIDTH];   // separable: weight of each col (left to right)
+    int center;                   // separable: added to the center weight
+    int weights[STENCIL_MAX_WIDTH][STENCIL_MAX_WIDTH]; // full weights
+};
+
+/**
+ * A filter: out = sum over terms of (absolute ? |term| : term), / divisor.
+ * Two terms with absolute set give a gradient magnitude (|Gx| + |Gy|).
+ * Division truncates toward zero, like C integer division.
+ */
+struct stencil_kernel {
+    const char* name;
+    int radius;
+    int divisor;
+    int absolute;
+    int num_terms;
+    struct stencil_term terms[STENCIL_MAX_TERMS];
+};
+
+// Built-in filters. The divisors keep inputs in [0, 255] within [0, 255].
+static const struct stencil_kernel stencil_kernels[] = {
+    // (a + b + c + d + 2e + f + g + h + i) / 10
+    { "weighted_avg", 1, 10, 0, 1, {{ 1, {1, 1, 1}, {1, 1, 1}, 1, {{0}} }} },
+    // 3x3 Gaussian, [1 2 1] x [1 2 1] / 16
+    { "blur3", 1, 16, 0, 1, {{ 1, {1, 2, 1}, {1, 2, 1}, 0, {{0}} }} },
+    // 5x5 Gaussian, [1 4 6 4 1] x [1 4 6 4 1] / 256
+    { "blur5", 2, 256, 0, 1, {{ 1, {1, 4, 6, 4, 1}, {1, 4, 6, 4, 1}, 0, {{0}} }} },
+    // 5x5 mean
+    { "box5", 2, 25, 0, 1, {{ 1, {1, 1, 1, 1, 1}, {1, 1, 1, 1, 1}, 0, {{0}} }} },
+    // Sobel gradient magnitude, (|Gx| + |Gy|) / 8
+    { "sobel", 1, 8, 1, 2, {
+        { 1, {1, 2, 1}, {-1, 0, 1}, 0, {{0}} },
+        { 1, {-1, 0, 1}, {1, 2, 1}, 0, {{0}} },
+    } },
+    // |4-neighbour Laplacian| / 4
+    { "laplacian", 1, 4, 1, 1, {{ 0, {0}, {0}, 0, {
+        {0, 1, 0},
+        {1, -4, 1},
+        {0, 1, 0},
+    } }} },
+};
+#define STENCIL_NUM_KERNELS ((int)(sizeof stencil_kernels / sizeof stencil_kernels[0]))
+
+/**
+ * Look up a built-in kernel by name. NULL if there's no such kernel.
+ */
+static inline const struct stencil_kernel* stencil_find(const char* const name) {
+    for (int k = 0; k < STENCIL_NUM_KERNELS; k++) {
+        if (strcmp(stencil_kernels[k].name, name) == 0) {
+            return &stencil_kernels[k];
+        }
+    }
+    return NULL;
+}
+
+//////////////////////////////
+// Row kernels
+//////////////////////////////
+#if defined(__GNUC__)
+#define STENCIL_INLINE static inline __attribute__((always_inline))
+#else
+#define STENCIL_INLINE static inline
+#endif
+
+/**
+ * Weight of neighbour (d, e), d and e in [0, 2r], for one term.
+ */
+STENCIL_INLINE int stencil_weight(const struct stencil_term* const t, const int r, const int d, const int e) {
+    if (t->separable) {
+        return t->col[d] * t->row[e] + ((d == r && e == r) ? t->center : 0);
+    }
+    return t->weights[d][e];
+}
+
+/**
+ * The filter loop for one kernel. Always inlined: called with one of the
+ * built-in kernels, every weight, the radius and the divisor become
+ * constants, so the neighbourhood loops unroll, zero weights drop out,
+ * multiplies by 1/2/4 become adds and shifts and the division by the
+ * divisor becomes a multiply. Each output is computed straight from the
+ * input rows in one pass, so no row buffers are written.
+ */
+STENCIL_INLINE void stencil_apply_kernel(const struct stencil_kernel* const k, const int M, const int N,
+                                         const stencil_pixel* const in, const int ldin,
+                                         stencil_pixel* const out, const int ldout) {
+    const int r = k->radius;
+    const int width = 2 * r + 1;
+
+    for (int x = 0; x < M; x++) {
+        const stencil_pixel* const row_in = &in[x * ldin];
+        stencil_pixel* const row_out = &out[x * ldout];
+
+        #pragma omp simd
+        for (int j = 0; j < N; j++) {
+            int acc = 0;
+            for (int t = 0; t < k->num_terms; t++) {
+                int v = 0;
+                for (int d = 0; d < width; d++) {
+                    for (int e = 0; e < width; e++) {
+                        v += stencil_weight(&k->terms[t], r, d, e) * row_in[(d - r) * ldin + (e - r) + j];
+                    }
+                }
+                acc += k->absolute ? abs(v) : v;
+            }
+            int v = acc / k->divisor;
+#ifdef STENCIL_PIXEL_MAX
+            v = (v < 0) ? 0 : (v > STENCIL_PIXEL_MAX) ? STENCIL_PIXEL_MAX : v;
+#endif
+            row_out[j] = (stencil_pixel)v;
+        }
+    }
+}
+
+// One specialized copy of the filter loop per built-in kernel.
+#define STENCIL_INSTANCE(i) \
+    static void stencil_apply_##i(const int M, const int N, const stencil_pixel* const in, const int ldin, \
+                                  stencil_pixel* const out, const int ldout) { \
+        stencil_apply_kernel(&stencil_kernels[i], M, N, in, ldin, out, ldout); \
+    }
+STENCIL_INSTANCE(0)
+STENCIL_INSTANCE(1)
+STENCIL_INSTANCE(2)
+STENCIL_INSTANCE(3)
+STENCIL_INSTANCE(4)
+STENCIL_INSTANCE(5)
+
+static void (* const stencil_instances[])(const int, const int, const stencil_pixel* const, const int, stencil_pixel* const, const int) = {
+    stencil_apply_0, stencil_apply_1, stencil_apply_2, stencil_apply_3, stencil_apply_4, stencil_apply_5,
+};
+
+_Static_assert(sizeof stencil_instances / sizeof stencil_instances[0] == sizeof stencil_kernels / sizeof stencil_kernels[0],
+               "every built-in stencil kernel needs a STENCIL_INSTANCE");
+
+//////////////////////////////
+// Public interface
+//////////////////////////////
+/**
+ * Filter an M x N block.
+ * in: first input element; the kernel's radius of cells around the block
+ * must be readable (ghost cells or the rest of the matrix).
+ * out: first output element. Must not overlap in.
+ * ldin, ldout: row strides (in elements).
+ *
+ * Built-in kernels run their specialized copy; any other kernel runs the
+ * same loop with the weights read at run time.
+ * Not internally threaded; callers split the rows across threads or ranks.
+ */
+static inline void stencil_apply(const struct stencil_kernel* const k, const int M, const int N,
+                                 const stencil_pixel* const in, const int ldin,
+                                 stencil_pixel* const out, const int ldout) {
+    if (k >= stencil_kernels && k < stencil_kernels + STENCIL_NUM_KERNELS) {
+        stencil_instances[k - stencil_kernels](M, N, in, ldin, out, ldout);
+    }
+    else {
+        stencil_apply_kernel(k, M, N, in, ldin, out, ldout);
+    }
+}
+
+#endif // STENCIL_H